@@ -24,12 +24,13 @@ void init() {
   constexpr static uintptr_t rsdp_area_end = 0x00100000;
   constexpr static ptrdiff_t rsdp_area_size = rsdp_area_end - rsdp_area_start;
 
-  paging::kernel_page_tables.identity_map_page_range_into_kernel_space(
-      rsdp_area_start, rsdp_area_size);
+  // This is BIOS ROM rather than RAM, so it isn't in the physmap.
+  auto *rsdp_area =
+      paging::map_mmio(rsdp_area_start, rsdp_area_size, paging::attributes::XD);
 
   // Find RDSP in the first 1KB of the EBDA, maybe?
   rsdp = reinterpret_cast<RSDP *>(
-      memstr((void *)rsdp_area_start, "RSD PTR ", rsdp_area_size));
+      memstr(rsdp_area, "RSD PTR ", rsdp_area_size));
 
   if (rsdp) {
     fprintf(stderr, "rsdp: %p\n", rsdp);
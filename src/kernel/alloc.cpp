@@ -1,137 +1,342 @@
 #include "alloc.h"
 
+#include "alloc_trace.h"
 #include "assert.h"
+#include "interrupts.h"
 #include "memory.h"
 #include "mutex.h"
+#include "panic.h"
 #include "util.h"
 #include "vma.h"
 #include "pma.h"
 #include "paging.h"
+#include "slab.h"
+#include "zero_pool.h"
 
 #include "libadt/small_string.h"
 
+#include <algorithm>
+
 using memory::PAGE_SIZE;
 using memory::PAGE_ALIGN;
+using memory::HUGE_PAGE_SIZE;
+using memory::HUGE_PAGE_ALIGN;
 
 template class adt::string_base<kstd::standard_alloc>;
 
 namespace alloc {
 
+// Metadata for one page-granular allocation. Descriptors are fixed-size, so
+// they can be recycled through a free list no matter how big the allocation
+// they described was. The physical pages backing an allocation aren't
+// recorded here, they're recovered from the page tables when it's freed.
 struct allocation {
-  allocation *next = nullptr;
+  // Base of the allocation's virtual pages, where the header lives.
+  void *base = nullptr;
+  // Size of the allocation in bytes, including the header (page-aligned).
   size_t size = 0;
-  size_t physical_page_list_size = 0;
-  uintptr_t physical_pages_used[];
+  // How many 2MiB pages back the allocation.
+  size_t huge_pages = 0;
+  // Next descriptor on the free list, while the descriptor is unused.
+  allocation *next_free = nullptr;
 };
 
 kstd::mutex malloc_lock;
 
-struct allocation_list {
-  allocation *first = nullptr;
+struct allocation_pool {
+  allocation *free_list = nullptr;
+  size_t live = 0;
+  size_t pages = 0;
+};
+allocation_pool allocations = {};
+
+struct huge_page_stats {
+  // Live allocations backed by at least one huge page.
+  size_t allocations = 0;
+  // Huge pages currently mapped by live allocations.
+  size_t pages = 0;
+  // Allocations that were big enough for huge pages, but had to fall back to
+  // 4KiB pages for (part of) their range since physical memory was too
+  // fragmented.
+  size_t fallbacks = 0;
 };
-allocation_list allocations = {};
+huge_page_stats huge_pages = {};
 
-void init() {
+constexpr static auto ALLOCATIONS_PER_PAGE = PAGE_SIZE / sizeof(allocation);
+
+// Records that `n` physical pages starting at `physical_page` belong to the
+// heap.
+static void mark_heap_pages(uintptr_t physical_page, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    pma::page_of(physical_page + i * PAGE_SIZE).owner = pma::page_owner::heap;
+}
+
+// Maps a fresh page of descriptors and puts them all on the free list.
+static void grow_allocation_pool() {
   const auto physical_address = pma::get_physical_page();
+  mark_heap_pages(physical_address, 1);
   const auto virtual_address = vma::get_virtual_pages(PAGE_SIZE);
-  allocations.first = static_cast<allocation *>(
+  auto *page = static_cast<allocation *>(
       paging::kernel_page_tables.map_page(physical_address, virtual_address));
+  for (auto i = ALLOCATIONS_PER_PAGE; i > 0; --i) {
+    page[i - 1] = allocation{};
+    page[i - 1].next_free = allocations.free_list;
+    allocations.free_list = &page[i - 1];
+  }
+  allocations.pages += 1;
+}
 
-  *allocations.first = allocation{};
-}
-
-static allocation *get_new_allocation(size_t n) {
-  allocation *list = allocations.first;
-  assert(list != nullptr &&
-         "Tried to get a new allocation, but allocation list is null");
-
-  // Find the last allocation node in the list. If we find a suitable killed
-  // node in the middle of the list instead, use that.
-  const auto num_physical_pages_needed = kstd::div_ceil(n, PAGE_SIZE);
-  allocation *last = list;
-  uint64_t allocation_list_size = 0;
-  allocation *new_allocation = nullptr;
-  while (true) {
-    allocation_list_size +=
-        sizeof(allocation) + sizeof(uintptr_t) * last->physical_page_list_size;
-
-    // Re-use killed node with the same physical page size
-    if (last->size == 0 &&
-        last->physical_page_list_size == num_physical_pages_needed) {
-      last->size = n;
-      return last;
-    }
+// A range of virtual pages handed out by `reserve`, committed one page at a
+// time by `handle_page_fault`.
+struct reservation {
+  void *base = nullptr;
+  size_t size = 0;
+};
 
-    // Exit once we've found the last node
-    if (last->next == nullptr)
-      break;
+constexpr static auto MAX_RESERVATIONS = 32;
+reservation reservations[MAX_RESERVATIONS] = {};
+
+struct demand_paging_stats {
+  size_t reservations = 0;
+  // Pages given their own zero-filled physical page after a write.
+  size_t committed_pages = 0;
+  // Pages mapped to the shared zero page after a read.
+  size_t zero_page_mappings = 0;
+};
+demand_paging_stats demand_paging = {};
+
+// Physical page of zeroes, mapped read-only into reserved ranges on a read
+// fault, so reading untouched memory doesn't commit anything.
+static uintptr_t zero_page = 0;
+
+// Physical pages set aside for faults that happen while `malloc_lock` is held
+// (e.g. a task switch touching reserved memory while the interrupted task was
+// in the middle of an allocation), when taking pages from the pma isn't safe.
+// Only touched with interrupts disabled.
+constexpr static auto FAULT_RESERVE_SIZE = 8;
+static uintptr_t fault_reserve[FAULT_RESERVE_SIZE];
+static size_t fault_reserve_count = 0;
+
+// A fault in a reservation that mapped `physical_page` at `virtual_page`.
+struct fault {
+  void *virtual_page;
+  uintptr_t physical_page;
+  // Whether it replaced a mapping of the zero page.
+  bool replaced_zero_page;
+};
 
-    last = last->next;
-  }
-
-  // Check if we have space in this page for a new allocation after the last
-  // one. If the allocation + physical pages would cross a page boundary,
-  // allocate a new page and put the new allocation there.
-  size_t size_of_new_allocation =
-      sizeof(allocation) + sizeof(uintptr_t) * num_physical_pages_needed;
-  if (allocation_list_size / PAGE_SIZE !=
-      (allocation_list_size + size_of_new_allocation) / PAGE_SIZE) {
-    assert(allocation_list_size + size_of_new_allocation <= PAGE_SIZE &&
-           "allocation node won't fit in one page!");
-    const auto physical_address = pma::get_physical_page();
-    const auto virtual_address = vma::get_virtual_pages(PAGE_SIZE);
-    new_allocation = static_cast<allocation *>(
-        paging::kernel_page_tables.map_page(physical_address, virtual_address));
+// Faults handled while someone else held `malloc_lock`. Their pages are
+// mapped, but the rest of the bookkeeping for them is left for whoever takes
+// the lock next. Only touched with interrupts disabled.
+constexpr static auto MAX_DEFERRED_FAULTS = 16;
+static fault deferred_faults[MAX_DEFERRED_FAULTS];
+static size_t deferred_fault_count = 0;
+
+// Must be called with `malloc_lock` held.
+static void account_fault(const fault &f) {
+  if (f.physical_page == zero_page) {
+    pma::get_page(zero_page);
+    demand_paging.zero_page_mappings += 1;
+  } else {
+    mark_heap_pages(f.physical_page, 1);
+    demand_paging.committed_pages += 1;
+  }
+  if (f.replaced_zero_page) {
+    // `alloc::init` still holds a reference, so this never frees it.
+    pma::put_page(zero_page);
+    demand_paging.zero_page_mappings -= 1;
   } else {
-    void *end_of_last_allocation =
-        &last->physical_pages_used[last->physical_page_list_size];
-    new_allocation = reinterpret_cast<allocation *>(end_of_last_allocation);
+    paging::kernel_page_tables.count_pinned_page(f.virtual_page);
   }
+}
+
+// Does the bookkeeping for deferred faults, and tops the fault reserve back
+// up. Called whenever the lock is about to be let go of after an allocation,
+// reallocation or free, so the reserve never runs dry for long. Must be called with
+// `malloc_lock` held.
+static void catch_up_on_faults() {
+  // Faults can only add to what's left to do, so anything they add after this
+  // check gets picked up next time.
+  if (deferred_fault_count == 0 && fault_reserve_count == FAULT_RESERVE_SIZE)
+    return;
+  const bool were_enabled = interrupts::enabled();
+  interrupts::disable();
+  for (size_t i = 0; i < deferred_fault_count; ++i)
+    account_fault(deferred_faults[i]);
+  deferred_fault_count = 0;
+  while (fault_reserve_count < FAULT_RESERVE_SIZE)
+    fault_reserve[fault_reserve_count++] = pma::get_physical_page();
+  if (were_enabled)
+    interrupts::enable();
+}
 
-  memset(new_allocation, 0, size_of_new_allocation);
-  new_allocation->next = nullptr;
-  new_allocation->size = n;
-  new_allocation->physical_page_list_size = num_physical_pages_needed;
+void init() {
+  grow_allocation_pool();
+
+  // Every read-only mapping of the zero page holds a reference to it, on top
+  // of this one, so it's never freed.
+  zero_page = pma::get_physical_page();
+  mark_heap_pages(zero_page, 1);
+  const auto zero_page_mapping = vma::get_virtual_pages(PAGE_SIZE);
+  memory::zero_pages(
+      paging::kernel_page_tables.map_page(zero_page, zero_page_mapping), 1);
+}
 
-  last->next = new_allocation;
+static allocation *get_new_allocation(void *base, size_t n) {
+  if (allocations.free_list == nullptr)
+    grow_allocation_pool();
 
+  allocation *new_allocation = allocations.free_list;
+  allocations.free_list = new_allocation->next_free;
+  *new_allocation = allocation{base, n, 0, nullptr};
+  allocations.live += 1;
   return new_allocation;
 }
 
 static void remove_allocation(allocation *node) {
-  // Set the allocation's size to 0 so it can be re-used later if possible
-  auto *last = allocations.first;
-  assert(last != nullptr &&
-         "Tried to remove an allocation, but allocation list is null");
-  for (; last->next != nullptr; last = last->next)
-    if (last->next == node)
-      break;
-  last->size = 0;
+  *node = allocation{};
+  node->next_free = allocations.free_list;
+  allocations.free_list = node;
+  allocations.live -= 1;
 }
 
-void *alloc(size_t n, kstd::Align alignment, protection p) {
-  if (n == 0) return nullptr;
+// Gets a physical page for a zeroed allocation, preferably one that's already
+// been cleared. Otherwise, `needs_zeroing` is set and the caller has to clear
+// it once it's mapped.
+static uintptr_t get_zeroed_physical_page(bool &needs_zeroing) {
+  if (const auto page = zero_pool::take()) {
+    needs_zeroing = false;
+    return *page;
+  }
+  needs_zeroing = true;
+  return pma::get_physical_page();
+}
 
-  const kstd::mutex::guard lock = malloc_lock.lock();
-  fprintf(stderr, "allocating %zd bytes with %lx alignment\n", n,
-          alignment.val);
+// The padding between the start of a page allocation and the address handed
+// out, which holds the `allocation *` and the alignment.
+static size_t padded_header_size_for(kstd::Align alignment) {
+  return kstd::align_to(sizeof(allocation *) + sizeof(kstd::Align::repr_type),
+                        alignment);
+}
+
+// Finds the descriptor of the page allocation that `p` was handed out for.
+static allocation *allocation_of(const void *p) {
+  const auto alignment = *((const kstd::Align::repr_type *)p - 1);
+  const auto header_address =
+      (uintptr_t)p - padded_header_size_for(kstd::Align{alignment});
+  const auto header = reinterpret_cast<allocation **>(header_address);
+  const auto allocation = *header;
+  assert(allocation && allocation->base == header &&
+         "bad pointer: can't find the allocation!");
+  return allocation;
+}
+
+// Maps `n` 4KiB pages starting at `start`, taking physical pages from the pma
+// in batches.
+static void map_small_pages(void *start, size_t n, paging::attributes attrs,
+                            bool zeroed) {
+  constexpr static size_t BATCH = 64;
+  uintptr_t batch[BATCH];
+  auto virtual_page = (uintptr_t)start;
+  while (n > 0) {
+    size_t count = 0;
+    // Pages from the zero pool are already cleared, so use those first.
+    while (zeroed && count < n && count < BATCH) {
+      const auto page = zero_pool::take();
+      if (!page)
+        break;
+      batch[count++] = *page;
+    }
+    const auto from_pool = count;
+    const auto from_pma = std::min(n, BATCH) - from_pool;
+    pma::get_physical_pages(from_pma, batch + from_pool);
+    count += from_pma;
+
+    for (size_t i = 0; i < count; ++i) {
+      mark_heap_pages(batch[i], 1);
+      paging::kernel_page_tables.map_page(batch[i], (void *)virtual_page,
+                                          attrs);
+      if (zeroed && i >= from_pool)
+        memory::zero_pages((void *)virtual_page, 1);
+      virtual_page += PAGE_SIZE;
+    }
+    n -= count;
+  }
+}
+
+// Backs [start, start + size) with fresh physical pages. Each whole, 2MiB
+// aligned chunk is mapped with a huge page, as long as we can find physically
+// contiguous memory for it, and the rest with 4KiB pages. Returns how many
+// huge pages were mapped.
+static size_t map_fresh_pages(void *start, size_t size,
+                              paging::attributes attrs, bool zeroed) {
+  bool try_huge_pages = size >= HUGE_PAGE_SIZE;
+  size_t huge_pages_mapped = 0;
+  for (size_t offset = 0; offset < size;) {
+    const auto virtual_page = (uintptr_t)start + offset;
+    if (try_huge_pages && virtual_page % HUGE_PAGE_SIZE == 0 &&
+        size - offset >= HUGE_PAGE_SIZE) {
+      if (const auto physical_page = pma::get_aligned_contiguous_physical_pages(
+              memory::PAGES_PER_HUGE_PAGE, HUGE_PAGE_ALIGN)) {
+        mark_heap_pages(*physical_page, memory::PAGES_PER_HUGE_PAGE);
+        paging::kernel_page_tables.map_huge_page(
+            *physical_page, (void *)virtual_page, attrs);
+        if (zeroed)
+          memory::zero_pages((void *)virtual_page,
+                             memory::PAGES_PER_HUGE_PAGE);
+        huge_pages_mapped += 1;
+        offset += HUGE_PAGE_SIZE;
+        continue;
+      }
+      // If one search failed, the next ones would too: don't bother.
+      try_huge_pages = false;
+      huge_pages.fallbacks += 1;
+    }
+    // Everything up to where the next huge page could go gets 4KiB pages.
+    auto end = size;
+    if (try_huge_pages) {
+      const auto next_huge_page =
+          kstd::align_to(virtual_page + 1, HUGE_PAGE_ALIGN);
+      end = std::min(size, next_huge_page - (uintptr_t)start);
+    }
+    map_small_pages((void *)virtual_page, (end - offset) / PAGE_SIZE, attrs,
+                    zeroed);
+    offset = end;
+  }
+  return huge_pages_mapped;
+}
+
+static void *alloc_locked(size_t n, kstd::Align alignment, protection p,
+                          bool zeroed, const void *caller) {
+  if (p == READ_WRITE && slab::serves(n, alignment)) {
+    void *object = slab::alloc(n);
+    if (zeroed)
+      memset(object, 0, n);
+    // `object_size` isn't free, so don't look it up unless it gets recorded.
+    if constexpr (trace::enabled)
+      trace::record_alloc(trace::op::alloc_slab, n, slab::object_size(object),
+                          alignment, object, caller);
+    catch_up_on_faults();
+    return object;
+  }
 
   // First find out how much space we need for the allocation header + alignment
   // info + padding to meet the given alignment.
-  const auto padded_header_size = kstd::align_to(
-      sizeof(struct allocation *) + sizeof(kstd::Align::repr_type), alignment);
-  fprintf(stderr, "-- header size: %lx\n", padded_header_size);
+  const auto padded_header_size = padded_header_size_for(alignment);
   // Now figure out how many pages we'll need to allocate `n` bytes + the
   // required space for the header.
   const auto size_with_header =
       kstd::align_to(n + padded_header_size, PAGE_ALIGN);
-  // Allocate the virtual addresses
-  const auto virtual_base_address = vma::get_virtual_pages(size_with_header);
-  fprintf(stderr, "-- starting addr: %p\n", virtual_base_address);
+  // Allocate the virtual addresses. Allocations of 2MiB or more are aligned
+  // so that they can be (at least partially) backed by huge pages.
+  const bool wants_huge_pages = size_with_header >= HUGE_PAGE_SIZE;
+  const auto virtual_base_address =
+      wants_huge_pages
+          ? vma::get_virtual_pages(size_with_header, HUGE_PAGE_ALIGN)
+          : vma::get_virtual_pages(size_with_header);
 
-  // Get a new entry in the allocations list
-  auto allocation = get_new_allocation(size_with_header);
-  fprintf(stderr, "-- allocation addr: %p\n", allocation);
+  // Get a new allocation descriptor
+  auto allocation = get_new_allocation(virtual_base_address, size_with_header);
 
   // Now we need to allocate physical pages to back the virtual addresses, then
   // map physical pages to virtual pages, and record physical page addresses.
@@ -144,68 +349,388 @@ void *alloc(size_t n, kstd::Align alignment, protection p) {
   case EXEC:
     break;
   }
-  const auto pages_needed = allocation->physical_page_list_size;
-  for (auto page = 0; page < (int)pages_needed; ++page) {
-    const auto page_offset = page * PAGE_SIZE;
-    const auto virtual_page =
-        (void *)((uintptr_t)(virtual_base_address) + page_offset);
-    const auto physical_page = pma::get_physical_page();
-    paging::kernel_page_tables.map_page(physical_page, virtual_page, attrs);
-
-    allocation->physical_pages_used[page] =
-        reinterpret_cast<uintptr_t>(physical_page);
+  allocation->huge_pages =
+      map_fresh_pages(virtual_base_address, size_with_header, attrs, zeroed);
+  if (allocation->huge_pages != 0) {
+    huge_pages.allocations += 1;
+    huge_pages.pages += allocation->huge_pages;
   }
 
   // Write the pointer to that entry into the allocation header
   auto header = reinterpret_cast<struct allocation **>(virtual_base_address);
-  fprintf(stderr, "-- header addr: %p\n", header);
   *header = allocation;
 
   const auto address_after_header =
       reinterpret_cast<uintptr_t>(virtual_base_address) + padded_header_size;
   void *addr = (void *)address_after_header;
   *((kstd::Align::repr_type *)addr - 1) = alignment.val;
-  fprintf(stderr, "-- final addr: %p\n", addr);
+  trace::record_alloc(trace::op::alloc_page, n, size_with_header, alignment,
+                      addr, caller);
+  catch_up_on_faults();
   return addr;
 }
 
+void *alloc(size_t n, kstd::Align alignment, protection p) {
+  if (n == 0) return nullptr;
+  const kstd::mutex::guard lock = malloc_lock.lock();
+  return alloc_locked(n, alignment, p, /*zeroed=*/false,
+                      __builtin_return_address(0));
+}
+
+void *alloc_zeroed(size_t n, kstd::Align alignment, protection p) {
+  assert(p != READ_ONLY && "can't zero-out read-only memory (add support?)");
+  if (n == 0) return nullptr;
+  const kstd::mutex::guard lock = malloc_lock.lock();
+  return alloc_locked(n, alignment, p, /*zeroed=*/true,
+                      __builtin_return_address(0));
+}
+
+static void free_locked(void *p, const void *caller) {
+  if (slab::owns(p)) {
+    if constexpr (trace::enabled)
+      trace::record_free(trace::op::free_slab, slab::object_size(p), p,
+                         caller);
+    slab::free(p);
+    catch_up_on_faults();
+    return;
+  }
+
+  const auto allocation = allocation_of(p);
+
+  // Re-add this virtual address to the free list
+  const auto virtual_address = allocation->base;
+  const auto size = allocation->size;
+  trace::record_free(trace::op::free_page, size, p, caller);
+  vma::free_virtual_pages(virtual_address, size);
+
+  // Unmap the whole range in one pass, and give its physical pages back once
+  // the TLB has been flushed.
+  {
+    paging::tlb_batch tlb;
+    paging::kernel_page_tables.unmap_range(
+        virtual_address, (char *)virtual_address + size, tlb,
+        /*free_pages=*/true);
+  }
+  if (allocation->huge_pages != 0) {
+    huge_pages.allocations -= 1;
+    huge_pages.pages -= allocation->huge_pages;
+  }
+
+  // Recycle the allocation's descriptor
+  remove_allocation(allocation);
+  catch_up_on_faults();
+}
+
 void free(void *p) {
   if (!p) return;
+  const kstd::mutex::guard lock = malloc_lock.lock();
+  free_locked(p, __builtin_return_address(0));
+}
+
+struct realloc_stats {
+  // Reallocations that grew into the virtual pages right after them.
+  size_t in_place = 0;
+  // Reallocations that had to move their pages to a bigger virtual range.
+  size_t remapped = 0;
+  // Reallocations of slab objects, which are always copied.
+  size_t copied = 0;
+};
+realloc_stats reallocs = {};
+
+// Moves every mapping in [from, from + size) to the same offset from `to`.
+// `to` has to be 2MiB aligned if the range contains any huge pages.
+static void move_mappings(void *from, void *to, size_t size) {
+  auto &tables = paging::kernel_page_tables;
+  for (size_t offset = 0; offset < size;) {
+    const auto old_page = (void *)((uintptr_t)from + offset);
+    const auto new_page = (void *)((uintptr_t)to + offset);
+    const auto entry = tables.find(old_page);
+    assert(entry != paging::page_tables::iterator::end() && entry.present() &&
+           "moving a page that isn't mapped!");
+    const auto physical_page = entry.physical_page_address();
+    const paging::attributes attrs =
+        *entry & (paging::attributes::RW | paging::attributes::XD);
+    if (entry.huge()) {
+      tables.unmap_huge_page(old_page);
+      tables.map_huge_page(physical_page, new_page, attrs);
+      offset += HUGE_PAGE_SIZE;
+    } else {
+      tables.unmap_page(old_page);
+      tables.map_page(physical_page, new_page, attrs);
+      offset += PAGE_SIZE;
+    }
+  }
+}
+
+// Picks a new virtual range for an allocation that has to move. Huge pages
+// only stay mappable if they land on 2MiB boundaries again, so the new base
+// has to sit at the same offset from a 2MiB boundary as the old one.
+static void *get_virtual_pages_for_move(const allocation *a, size_t new_size) {
+  if (a->huge_pages == 0)
+    return new_size >= HUGE_PAGE_SIZE
+               ? vma::get_virtual_pages(new_size, HUGE_PAGE_ALIGN)
+               : vma::get_virtual_pages(new_size);
+
+  const auto offset = (uintptr_t)a->base % HUGE_PAGE_SIZE;
+  const auto padded_size = new_size + HUGE_PAGE_SIZE;
+  auto *range = (char *)vma::get_virtual_pages(padded_size, HUGE_PAGE_ALIGN);
+  if (offset != 0)
+    vma::free_virtual_pages(range, offset);
+  const auto tail = padded_size - offset - new_size;
+  vma::free_virtual_pages(range + offset + new_size, tail);
+  return range + offset;
+}
+
+void *realloc(void *p, size_t n) {
+  if (!p)
+    return alloc(n, kstd::Align{alignof(max_align_t)}, READ_WRITE);
+  if (n == 0) {
+    free(p);
+    return nullptr;
+  }
 
   const kstd::mutex::guard lock = malloc_lock.lock();
-  fprintf(stderr, "freeing %p\n", p);
-
-  const auto alignment = *((kstd::Align::repr_type *)p - 1);
-  fprintf(stderr, " -- alignment: %lx\n", alignment);
-  const auto padded_header_size =
-      kstd::align_to(sizeof(allocation *) + sizeof(kstd::Align::repr_type),
-                     kstd::Align{alignment});
-  fprintf(stderr, " -- header size: %lx\n", padded_header_size);
-  const auto header_address =
-      reinterpret_cast<uintptr_t>(p) - padded_header_size;
-  const auto header = reinterpret_cast<allocation **>(header_address);
-  fprintf(stderr, " -- header addr: %p\n", header);
-  const auto allocation = *header;
-  fprintf(stderr, " -- allocation addr: %p\n", header);
-  assert(allocation && "bad free: can't find the allocation!");
+  const auto caller = __builtin_return_address(0);
 
-  // Re-add this virtual address to the free list
-  const auto virtual_address = header;
-  vma::free_virtual_pages(virtual_address, allocation->size);
-
-  // Add each physical page used to the page stack, and unmap each page entry
-  uintptr_t *entry = allocation->physical_pages_used;
-  for (auto page = 0; page < (int)allocation->physical_page_list_size; ++page) {
-    const auto physical_page_address = reinterpret_cast<void *>(*entry++);
-    pma::free_physical_page(physical_page_address);
-
-    const auto page_offset = page * PAGE_SIZE;
-    const auto virtual_page =
-        (void *)((uintptr_t)(virtual_address) + page_offset);
+  if (slab::owns(p)) {
+    const auto object_size = slab::object_size(p);
+    if (n <= object_size) {
+      catch_up_on_faults();
+      return p;
+    }
+    // The original alignment isn't recorded, so assume the strictest one a
+    // slab could have served.
+    void *moved =
+        alloc_locked(n, slab::MAX_OBJECT_ALIGN, READ_WRITE, false, caller);
+    memcpy(moved, p, object_size);
+    free_locked(p, caller);
+    reallocs.copied += 1;
+    catch_up_on_faults();
+    return moved;
+  }
+
+  const auto allocation = allocation_of(p);
+  const auto alignment = kstd::Align{*((kstd::Align::repr_type *)p - 1)};
+  const auto padded_header_size = padded_header_size_for(alignment);
+  const auto old_size = allocation->size;
+  const auto new_size = kstd::align_to(n + padded_header_size, PAGE_ALIGN);
+  // Shrinking keeps the pages around: a buffer that shrank is likely to grow
+  // back.
+  if (new_size <= old_size) {
+    catch_up_on_faults();
+    return p;
+  }
+
+  // Every page of an allocation is mapped with the same attributes.
+  const auto first_page = paging::kernel_page_tables.find(allocation->base);
+  const paging::attributes attrs =
+      *first_page & (paging::attributes::RW | paging::attributes::XD);
+  trace::record_free(trace::op::free_page, old_size, p, caller);
+
+  void *new_base = allocation->base;
+  if (vma::try_claim((char *)allocation->base + old_size, new_size - old_size)) {
+    reallocs.in_place += 1;
+  } else {
+    // Can't grow in place, so move the existing pages (not their contents) to
+    // a range with room for the new ones.
+    new_base = get_virtual_pages_for_move(allocation, new_size);
+    move_mappings(allocation->base, new_base, old_size);
+    vma::free_virtual_pages(allocation->base, old_size);
+    reallocs.remapped += 1;
+  }
+
+  const auto huge_pages_added =
+      map_fresh_pages((char *)new_base + old_size, new_size - old_size, attrs,
+                      /*zeroed=*/false);
+  if (allocation->huge_pages == 0 && huge_pages_added != 0)
+    huge_pages.allocations += 1;
+  huge_pages.pages += huge_pages_added;
+  allocation->huge_pages += huge_pages_added;
+  allocation->base = new_base;
+  allocation->size = new_size;
+
+  void *addr = (char *)new_base + padded_header_size;
+  trace::record_alloc(trace::op::alloc_page, n, new_size, alignment, addr,
+                      caller);
+  catch_up_on_faults();
+  return addr;
+}
+
+void *reserve(size_t n) {
+  assert(n != 0 && "trying to reserve 0 bytes?");
+  const kstd::mutex::guard lock = malloc_lock.lock();
+
+  reservation *slot = nullptr;
+  for (auto &r : reservations)
+    if (r.base == nullptr) {
+      slot = &r;
+      break;
+    }
+  if (!slot)
+    kstd::panic("out of reservation slots!");
+
+  const auto size = kstd::align_to(n, PAGE_ALIGN);
+  *slot = reservation{vma::get_virtual_pages(size), size};
+  // Faults in the reservation can come while someone else holds the lock, so
+  // its page tables have to be there ahead of time, and stay there.
+  paging::kernel_page_tables.pin_tables(slot->base,
+                                        (char *)slot->base + size);
+  demand_paging.reservations += 1;
+  catch_up_on_faults();
+  return slot->base;
+}
+
+void release(void *p) {
+  const kstd::mutex::guard lock = malloc_lock.lock();
+  catch_up_on_faults();
+  reservation *r = nullptr;
+  for (auto &candidate : reservations)
+    if (candidate.base == p) {
+      r = &candidate;
+      break;
+    }
+  assert(r && "bad release: not a reservation!");
+
+  for (size_t offset = 0; offset < r->size; offset += PAGE_SIZE) {
+    const auto virtual_page = (void *)((uintptr_t)r->base + offset);
+    const auto entry = paging::kernel_page_tables.find(virtual_page);
+    if (entry == paging::page_tables::iterator::end() || !entry.present())
+      continue;
+    const auto physical_page = entry.physical_page_address();
     paging::kernel_page_tables.unmap_page(virtual_page);
+    if (physical_page == zero_page) {
+      pma::put_page(zero_page);
+      demand_paging.zero_page_mappings -= 1;
+    } else {
+      pma::free_physical_page((void *)physical_page);
+      demand_paging.committed_pages -= 1;
+    }
   }
+  paging::kernel_page_tables.unpin_tables(r->base, (char *)r->base + r->size);
+  vma::free_virtual_pages(r->base, r->size);
+  *r = reservation{};
+  demand_paging.reservations -= 1;
+}
 
-  // Remove the allocation from the allocation list
-  remove_allocation(allocation);
+void *alloc_stack(size_t size) {
+  size = kstd::align_to(size, PAGE_ALIGN);
+  const kstd::mutex::guard lock = malloc_lock.lock();
+  auto *stack = vma::get_stack(size);
+  map_small_pages(stack, size / PAGE_SIZE,
+                  paging::attributes::RW | paging::attributes::XD,
+                  /*zeroed=*/false);
+  return stack;
+}
+
+void free_stack(void *stack, size_t size) {
+  size = kstd::align_to(size, PAGE_ALIGN);
+  const kstd::mutex::guard lock = malloc_lock.lock();
+  {
+    paging::tlb_batch tlb;
+    paging::kernel_page_tables.unmap_range(stack, (char *)stack + size, tlb,
+                                           /*free_pages=*/true);
+  }
+  vma::free_stack(stack);
+}
+
+bool handle_page_fault(void *address, bool write) {
+  const reservation *r = nullptr;
+  for (const auto &candidate : reservations)
+    if (candidate.base != nullptr && address >= candidate.base &&
+        (uintptr_t)address < (uintptr_t)candidate.base + candidate.size) {
+      r = &candidate;
+      break;
+    }
+  if (!r)
+    return false;
+
+  const auto virtual_page = (void *)((uintptr_t)address & -PAGE_SIZE);
+  auto &tables = paging::kernel_page_tables;
+  const auto entry = tables.find(virtual_page);
+  const bool mapped =
+      entry != paging::page_tables::iterator::end() && entry.present();
+  // A read of an already-mapped page isn't ours to handle, and writes to a
+  // committed page would've succeeded, so the only present page we can fix up
+  // is the read-only zero page.
+  if (mapped && (!write || entry.physical_page_address() != zero_page))
+    return false;
+
+  // Whoever we interrupted might be halfway through an allocation, in which
+  // case we have to make do with the fault reserve, and leave the bookkeeping
+  // for later. The reservation's page tables are pinned, so mapping the page
+  // doesn't need the lock, as long as their counts are left for later too.
+  const bool locked = malloc_lock.try_acquire();
+  fault f{virtual_page, zero_page, mapped};
+  bool needs_zeroing = write;
+  if (write) {
+    if (locked) {
+      f.physical_page = get_zeroed_physical_page(needs_zeroing);
+    } else {
+      if (fault_reserve_count == 0)
+        kstd::panic(
+            "page fault at %p with no pages left in the fault reserve!",
+            address);
+      f.physical_page = fault_reserve[--fault_reserve_count];
+    }
+  }
+
+  tables.map_pinned_page(f.physical_page, virtual_page,
+                         write ? paging::attributes::RW | paging::attributes::XD
+                               : paging::attributes::XD);
+  if (needs_zeroing)
+    memory::zero_pages(virtual_page, 1);
+
+  if (locked) {
+    account_fault(f);
+    catch_up_on_faults();
+    malloc_lock.release();
+  } else {
+    if (deferred_fault_count == MAX_DEFERRED_FAULTS)
+      kstd::panic("page fault at %p with too many faults waiting for the "
+                  "allocator lock!",
+                  address);
+    deferred_faults[deferred_fault_count++] = f;
+  }
+  return true;
+}
+
+bool handle_copy_on_write_fault(void *address) {
+  if (!malloc_lock.try_acquire()) {
+    // Whoever we interrupted was preempted halfway through an allocation, and
+    // can't be the one writing to the page. Returning without doing anything
+    // has the write fault again, until they're done.
+    return paging::is_copy_on_write(address);
+  }
+  const bool handled = paging::handle_copy_on_write_fault(address);
+  malloc_lock.release();
+  return handled;
+}
+
+void dump_stats(FILE *out) {
+  const kstd::mutex::guard lock = malloc_lock.lock();
+  catch_up_on_faults();
+  fprintf(out, "alloc: %zu page allocation(s) live, %zu descriptor page(s)\n",
+          allocations.live, allocations.pages);
+  fprintf(out,
+          "alloc: %zu allocation(s) backed by %zu huge page(s), "
+          "%zu fell back to 4KiB pages\n",
+          huge_pages.allocations, huge_pages.pages, huge_pages.fallbacks);
+  fprintf(out,
+          "alloc: realloc grew %zu in place, remapped %zu, copied %zu\n",
+          reallocs.in_place, reallocs.remapped, reallocs.copied);
+  fprintf(out,
+          "alloc: %zu reservation(s), %zu page(s) committed, %zu page(s) "
+          "reading the zero page\n",
+          demand_paging.reservations, demand_paging.committed_pages,
+          demand_paging.zero_page_mappings);
+  pma::dump_stats(out);
+  zero_pool::dump_stats(out);
+  slab::dump_stats(out);
+  trace::dump_stats(out);
+}
+
+void dump_trace(FILE *out) {
+  const kstd::mutex::guard lock = malloc_lock.lock();
+  trace::dump_events(out);
 }
 } // namespace alloc
@@ -4,11 +4,20 @@
 #include <assert.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdio.h>
 
 #include "util.h"
 
+namespace kstd {
+struct mutex;
+}
+
 namespace alloc {
 
+// Protects all of the allocator's state, including the pma, vma and kernel
+// page tables that it drives.
+extern kstd::mutex malloc_lock;
+
 enum protection {
   READ_ONLY,
   READ_WRITE,
@@ -19,13 +28,40 @@ void init();
 
 void *alloc(size_t count, kstd::Align alignment, protection p);
 void free(void *data);
+// Resizes the allocation at `data`, keeping its contents. Page allocations
+// grow in place when the virtual pages after them are free, and otherwise
+// have their existing pages remapped to a bigger range, so the contents are
+// never copied. Either way, only the added pages cost anything.
+void *realloc(void *data, size_t count);
 
-inline void *alloc_zeroed(size_t count, kstd::Align alignment, protection p) {
-  assert(p != READ_ONLY && "can't zero-out read-only memory (add support?)");
-  void *ret = alloc(count, alignment, p);
-  memset(ret, 0, count);
-  return ret;
-}
+// Reserves `count` bytes of page-aligned virtual memory without backing it.
+// The memory reads as zeroes, and each page is only committed (to a fresh,
+// zero-filled physical page) the first time it's written. Must be given back
+// with `release`, not `free`.
+void *reserve(size_t count);
+void release(void *data);
+
+// Allocates a `size` byte kernel stack, at the top of its own slot in the
+// stacks region so that an unmapped guard gap sits below it. Returns the
+// lowest address of the stack, which grows down from `stack + size`.
+void *alloc_stack(size_t size);
+void free_stack(void *stack, size_t size);
+
+// Called by the page fault handler. Commits the page containing `address` if
+// it's part of a reservation, and returns whether the fault was handled.
+bool handle_page_fault(void *address, bool write);
+// Called by the page fault handler on writes to present pages. Copies the page
+// containing `address` if it's copy-on-write, and returns whether the fault
+// was handled.
+bool handle_copy_on_write_fault(void *address);
+
+void dump_stats(FILE *out);
+// Prints (and drains) the allocator's event trace, when it's compiled in.
+void dump_trace(FILE *out);
+
+// Like `alloc`, but the memory is zeroed. Whole pages are taken from the
+// pre-zeroed pool when possible, instead of being cleared here.
+void *alloc_zeroed(size_t count, kstd::Align alignment, protection p);
 
 template <typename T, kstd::Align A = kstd::align_of<T>>
 T *one(protection p = protection::READ_WRITE) {
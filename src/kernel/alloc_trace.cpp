@@ -0,0 +1,100 @@
+#include "alloc_trace.h"
+
+#if KERNEL_ALLOC_TRACE
+
+#include "libadt/ring_buffer.h"
+
+namespace alloc::trace {
+
+constexpr static size_t MAX_EVENTS = 0x800;
+// Bucket `i` counts requests of [2^i, 2^(i+1)) bytes.
+constexpr static size_t NUM_SIZE_BUCKETS = 32;
+
+static adt::ring_buffer<event, MAX_EVENTS> events;
+static uint64_t size_histogram[NUM_SIZE_BUCKETS];
+static uint64_t dropped_events = 0;
+
+static uint64_t live_allocations = 0;
+static uint64_t peak_live_allocations = 0;
+static uint64_t live_bytes = 0;
+static uint64_t peak_live_bytes = 0;
+static uint64_t total_allocations = 0;
+static uint64_t total_frees = 0;
+
+static void push(const event &e) {
+  if (events.full()) {
+    events.pop_front();
+    dropped_events += 1;
+  }
+  events.push_back(e);
+}
+
+static const char *op_name(op kind) {
+  switch (kind) {
+  case op::alloc_page:
+    return "alloc_page";
+  case op::alloc_slab:
+    return "alloc_slab";
+  case op::free_page:
+    return "free_page";
+  case op::free_slab:
+    return "free_slab";
+  }
+  return "<error>";
+}
+
+void record_alloc(op kind, size_t size, size_t footprint, kstd::Align alignment,
+                  const void *address, const void *caller) {
+  push(event{(uint64_t)address, (uint64_t)caller,
+             size > UINT32_MAX ? UINT32_MAX : (uint32_t)size, kind,
+             (uint8_t)kstd::log2_floor(alignment.val), 0});
+
+  auto bucket = (size_t)kstd::log2_floor(size);
+  if (bucket >= NUM_SIZE_BUCKETS)
+    bucket = NUM_SIZE_BUCKETS - 1;
+  size_histogram[bucket] += 1;
+
+  total_allocations += 1;
+  if (++live_allocations > peak_live_allocations)
+    peak_live_allocations = live_allocations;
+  live_bytes += footprint;
+  if (live_bytes > peak_live_bytes)
+    peak_live_bytes = live_bytes;
+}
+
+void record_free(op kind, size_t footprint, const void *address,
+                 const void *caller) {
+  push(event{(uint64_t)address, (uint64_t)caller,
+             footprint > UINT32_MAX ? UINT32_MAX : (uint32_t)footprint, kind,
+             0, 0});
+
+  total_frees += 1;
+  live_allocations -= 1;
+  live_bytes -= footprint;
+}
+
+void dump_stats(FILE *out) {
+  fprintf(out,
+          "alloc trace: %lu alloc(s), %lu free(s), %lu live (peak %lu), "
+          "%lu bytes live (peak %lu)\n",
+          total_allocations, total_frees, live_allocations,
+          peak_live_allocations, live_bytes, peak_live_bytes);
+  for (size_t i = 0; i < NUM_SIZE_BUCKETS; ++i)
+    if (size_histogram[i] != 0)
+      fprintf(out, "alloc trace: [%lu, %lu) bytes: %lu\n", 1UL << i,
+              1UL << (i + 1), size_histogram[i]);
+}
+
+void dump_events(FILE *out) {
+  fprintf(out, "alloc trace: %zu event(s), %lu dropped\n", events.size(),
+          dropped_events);
+  while (const auto e = events.pop_front())
+    fprintf(out, "%s 0x%p size=%u align=%lu caller=0x%p\n", op_name(e->kind),
+            (void *)e->address, e->size, 1UL << e->log2_alignment,
+            (void *)e->caller);
+  dropped_events = 0;
+}
+
+} // namespace alloc::trace
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef KERNEL_ALLOC_TRACE_H
+#define KERNEL_ALLOC_TRACE_H
+
+#include "util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Allocator tracing, enabled by configuring with -DKERNEL_ALLOC_TRACE=ON.
+//
+// When enabled, every alloc/free is recorded as a compact binary event in an
+// in-memory ring buffer (the oldest events get overwritten), alongside a
+// histogram of requested sizes and live/peak usage counters. When disabled,
+// every hook is an empty inline function and compiles away entirely.
+//
+// Like the allocator internals, none of this locks: the hooks are expected to
+// be called with `alloc::malloc_lock` held.
+namespace alloc::trace {
+
+enum class op : uint8_t {
+  alloc_page,
+  alloc_slab,
+  free_page,
+  free_slab,
+};
+
+struct event {
+  uint64_t address;
+  uint64_t caller;
+  // Requested size for allocations, footprint for frees.
+  uint32_t size;
+  op kind;
+  uint8_t log2_alignment;
+  uint16_t reserved;
+};
+static_assert(sizeof(event) == 24);
+
+#if KERNEL_ALLOC_TRACE
+constexpr static bool enabled = true;
+
+// `footprint` is how much memory the allocation actually takes up, i.e. the
+// slab object size or the page-aligned size of the page allocation.
+void record_alloc(op kind, size_t size, size_t footprint, kstd::Align alignment,
+                  const void *address, const void *caller);
+void record_free(op kind, size_t footprint, const void *address,
+                 const void *caller);
+
+// Prints the size histogram and usage counters.
+void dump_stats(FILE *out);
+// Prints every event in the ring buffer, oldest first, and empties it.
+void dump_events(FILE *out);
+#else
+constexpr static bool enabled = false;
+
+inline void record_alloc(op, size_t, size_t, kstd::Align, const void *,
+                         const void *) {}
+inline void record_free(op, size_t, const void *, const void *) {}
+inline void dump_stats(FILE *) {}
+inline void dump_events(FILE *out) {
+  fputs("alloc trace: disabled (configure with -DKERNEL_ALLOC_TRACE=ON)\n",
+        out);
+}
+#endif
+
+} // namespace alloc::trace
+
+#endif
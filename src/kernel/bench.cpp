@@ -0,0 +1,333 @@
+#include "bench.h"
+
+#include "alloc.h"
+#include "interrupts.h"
+#include "memory.h"
+#include "mutex.h"
+#include "paging.h"
+#include "pma.h"
+#include "slab.h"
+#include "util.h"
+#include "vga.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace bench {
+
+// Measures page allocator alloc/free latency with an increasing number of
+// allocations kept live in the background. The per-op cost should stay flat.
+static void alloc_latency() {
+  constexpr size_t live_counts[] = {10, 100, 1000, 10000, 100000};
+  constexpr size_t max_live = live_counts[sizeof(live_counts) /
+                                          sizeof(live_counts[0]) - 1];
+  constexpr size_t BATCH = 100;
+  constexpr size_t ROUNDS = 10;
+  // Too big for a slab, but still a single page once the header is added.
+  constexpr size_t ALLOCATION_SIZE = slab::MAX_OBJECT_SIZE + 1;
+
+  auto **live = alloc::array_of<void *>(max_live);
+  void *batch[BATCH];
+  for (const auto count : live_counts) {
+    if (count + BATCH + 0x100 > pma::get_free_page_count()) {
+      printf("alloc_latency: %zu live: skipped, not enough physical memory\n",
+             count);
+      continue;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+      live[i] = alloc::alloc(ALLOCATION_SIZE, kstd::Align{1},
+                             alloc::protection::READ_WRITE);
+
+    uint64_t alloc_cycles = 0;
+    uint64_t free_cycles = 0;
+    for (size_t round = 0; round < ROUNDS; ++round) {
+      const auto start = rdtsc();
+      for (auto &p : batch)
+        p = alloc::alloc(ALLOCATION_SIZE, kstd::Align{1},
+                         alloc::protection::READ_WRITE);
+      const auto middle = rdtsc();
+      for (auto *p : batch)
+        alloc::free(p);
+      const auto end = rdtsc();
+      alloc_cycles += middle - start;
+      free_cycles += end - middle;
+    }
+
+    printf("alloc_latency: %zu live: alloc %lu cycles, free %lu cycles\n",
+           count, alloc_cycles / (BATCH * ROUNDS),
+           free_cycles / (BATCH * ROUNDS));
+
+    for (size_t i = 0; i < count; ++i)
+      alloc::free(live[i]);
+  }
+  alloc::free(live);
+}
+
+// Grows a buffer by doubling, once with `realloc` and once by allocating,
+// copying and freeing. realloc should only pay for the pages it adds.
+static void realloc_growth() {
+  constexpr size_t START_SIZE = memory::PAGE_SIZE;
+  constexpr size_t END_SIZE = 0x800000;
+  if (2 * END_SIZE / memory::PAGE_SIZE + 0x100 > pma::get_free_page_count()) {
+    puts("realloc_growth: skipped, not enough physical memory");
+    return;
+  }
+
+  uint64_t realloc_cycles = 0;
+  void *buffer = alloc::alloc(START_SIZE, kstd::Align{16},
+                              alloc::protection::READ_WRITE);
+  for (size_t size = START_SIZE * 2; size <= END_SIZE; size *= 2) {
+    const auto start = rdtsc();
+    buffer = alloc::realloc(buffer, size);
+    realloc_cycles += rdtsc() - start;
+  }
+  alloc::free(buffer);
+
+  uint64_t copy_cycles = 0;
+  buffer = alloc::alloc(START_SIZE, kstd::Align{16},
+                        alloc::protection::READ_WRITE);
+  for (size_t size = START_SIZE * 2; size <= END_SIZE; size *= 2) {
+    const auto start = rdtsc();
+    void *bigger =
+        alloc::alloc(size, kstd::Align{16}, alloc::protection::READ_WRITE);
+    memcpy(bigger, buffer, size / 2);
+    alloc::free(buffer);
+    buffer = bigger;
+    copy_cycles += rdtsc() - start;
+  }
+  alloc::free(buffer);
+
+  printf("realloc_growth: %zuKiB -> %zuKiB: realloc %lu cycles, "
+         "alloc+copy+free %lu cycles\n",
+         START_SIZE / 1024, END_SIZE / 1024, realloc_cycles, copy_cycles);
+}
+
+// Frees allocations made of hundreds of 4KiB pages, once with every page
+// invalidated by its own `invlpg` and once with the default threshold for
+// flushing the whole TLB instead.
+static void free_large() {
+  // Just under 2MiB with the header, so they never get huge pages.
+  constexpr size_t sizes[] = {0x40000, 0x100000, 0x1ff000};
+  constexpr size_t ROUNDS = 16;
+  const auto default_threshold = paging::tlb_full_flush_threshold;
+  for (const auto size : sizes) {
+    if (size / memory::PAGE_SIZE + 0x100 > pma::get_free_page_count()) {
+      printf("free_large: %zuKiB: skipped, not enough physical memory\n",
+             size / 1024);
+      continue;
+    }
+    uint64_t cycles[2] = {0, 0};
+    const size_t thresholds[2] = {(size_t)-1, default_threshold};
+    for (int t = 0; t < 2; ++t) {
+      paging::tlb_full_flush_threshold = thresholds[t];
+      for (size_t round = 0; round < ROUNDS; ++round) {
+        void *p = alloc::alloc(size - 0x100, kstd::Align{16},
+                               alloc::protection::READ_WRITE);
+        const auto start = rdtsc();
+        alloc::free(p);
+        cycles[t] += rdtsc() - start;
+      }
+    }
+    paging::tlb_full_flush_threshold = default_threshold;
+    printf("free_large: %zuKiB: %lu cycles with invlpg per page, %lu cycles "
+           "batched\n",
+           size / 1024, cycles[0] / ROUNDS, cycles[1] / ROUNDS);
+  }
+}
+
+// Switches back and forth between the kernel's address space and a user one,
+// touching a working set of user pages after each switch into it. Once with
+// the TLB flushed on every switch, and once keeping each PCID's entries
+// around. Kernel mappings are global and survive either way, so only the
+// user half shows the difference.
+static void context_switch() {
+  constexpr size_t PAGES = 64;
+  constexpr size_t ROUNDS = 1000;
+  constexpr uintptr_t USER_BASE = 0x400000;
+  if (!paging::pcid_supported())
+    puts("context_switch: no PCIDs on this CPU, both runs flush");
+
+  paging::page_tables *address_space;
+  {
+    const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+    address_space = paging::allocate_user_space_page_tables();
+    uintptr_t pages[PAGES];
+    pma::get_physical_pages(PAGES, pages);
+    for (size_t i = 0; i < PAGES; ++i)
+      address_space->map_page(
+          pages[i], (void *)(USER_BASE + i * memory::PAGE_SIZE),
+          paging::attributes::RW | paging::attributes::USER |
+              paging::attributes::XD);
+  }
+  const auto *buffer = (volatile char *)USER_BASE;
+  const auto touch = [&]() {
+    for (size_t i = 0; i < PAGES; ++i)
+      (void)buffer[i * memory::PAGE_SIZE];
+  };
+
+  uint64_t cycles[2] = {0, 0};
+  const auto default_use_pcid = paging::use_pcid;
+  {
+    // The scheduler would switch address spaces behind our back.
+    interrupts::scoped_disable disable;
+    for (int with_pcid = 0; with_pcid < 2; ++with_pcid) {
+      paging::use_pcid = with_pcid;
+      for (size_t round = 0; round < ROUNDS; ++round) {
+        const auto start = rdtsc();
+        paging::switch_to(*address_space);
+        touch();
+        paging::switch_to(paging::kernel_page_tables);
+        cycles[with_pcid] += rdtsc() - start;
+      }
+    }
+  }
+  paging::use_pcid = default_use_pcid;
+  printf("context_switch: %zu pages touched: %lu cycles per switch flushing, "
+         "%lu cycles with PCIDs\n",
+         PAGES, cycles[0] / (2 * ROUNDS), cycles[1] / (2 * ROUNDS));
+
+  const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+  {
+    paging::tlb_batch tlb;
+    address_space->unmap_range(
+        (void *)USER_BASE, (void *)(USER_BASE + PAGES * memory::PAGE_SIZE),
+        tlb, /*free_pages=*/true);
+  }
+  paging::free_user_space_page_tables(address_space);
+}
+
+// Clones address spaces with more and more user pages resident. Only the tables
+// get copied, so the cost should follow the number of tables rather than the
+// memory mapped. Copying the pages outright is timed for comparison.
+static void clone_latency() {
+  constexpr size_t resident_pages[] = {0, 64, 512, 4096, 16384};
+  constexpr size_t max_pages = resident_pages[sizeof(resident_pages) /
+                                              sizeof(resident_pages[0]) - 1];
+  constexpr uintptr_t USER_BASE = 0x400000;
+
+  auto *pages = alloc::array_of<uintptr_t>(max_pages);
+  void *scratch;
+  {
+    const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+    scratch = memory::phys_to_virt(pma::get_physical_page());
+  }
+  for (const auto count : resident_pages) {
+    if (count + 0x100 > pma::get_free_page_count()) {
+      printf("clone_latency: %zu pages: skipped, not enough physical memory\n",
+             count);
+      continue;
+    }
+
+    paging::page_tables *parent;
+    paging::page_tables *child;
+    uint64_t clone_cycles;
+    {
+      const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+      parent = paging::allocate_user_space_page_tables();
+      if (count > 0)
+        pma::get_physical_pages(count, pages);
+      for (size_t i = 0; i < count; ++i)
+        parent->map_page(pages[i], (void *)(USER_BASE + i * memory::PAGE_SIZE),
+                         paging::attributes::RW | paging::attributes::USER |
+                             paging::attributes::XD);
+
+      const auto start = rdtsc();
+      child = paging::clone_user_space_page_tables(*parent);
+      clone_cycles = rdtsc() - start;
+    }
+
+    const auto start = rdtsc();
+    for (size_t i = 0; i < count; ++i)
+      memcpy(scratch, memory::phys_to_virt(pages[i]), memory::PAGE_SIZE);
+    const auto copy_cycles = rdtsc() - start;
+
+    printf("clone_latency: %zu pages: clone %lu cycles, copying them %lu "
+           "cycles\n",
+           count, clone_cycles, copy_cycles);
+
+    const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+    paging::free_user_space_page_tables(child);
+    paging::free_user_space_page_tables(parent);
+  }
+  {
+    const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+    pma::free_physical_page((void *)memory::virt_to_phys(scratch));
+  }
+  alloc::free(pages);
+}
+
+// Fills the VGA text buffer through a mapping of it that's uncached, as it was
+// before it had a memory type of its own, and then through a write-combining
+// one.
+static void screen_fill() {
+  constexpr size_t ROUNDS = 1000;
+  // Device mappings are never freed, so keep these for the next run.
+  static volatile uint64_t *mappings[2];
+  const paging::attributes types[2] = {paging::attributes::CACHE_DISABLE,
+                                       paging::attributes::WRITE_COMBINING};
+  for (int i = 0; i < 2; ++i)
+    if (mappings[i] == nullptr)
+      mappings[i] = (volatile uint64_t *)paging::map_mmio(
+          vga::VGA_MEMORY_BASE_ADDRESS, vga::VGA_MEMORY_SIZE,
+          paging::attributes::RW | paging::attributes::XD | types[i]);
+
+  uint64_t cycles[2] = {0, 0};
+  {
+    // Nothing else gets to write to the screen until it's cleared again.
+    auto screen = vga::current_screen.lock();
+    for (int i = 0; i < 2; ++i) {
+      for (size_t round = 0; round < ROUNDS; ++round) {
+        // White on black, with a different printable character every round.
+        const uint64_t cell = 0x0f00 | (' ' + round % 0x5f);
+        const uint64_t c = cell * 0x0001000100010001;
+        const auto start = rdtsc();
+        for (size_t j = 0; j < vga::VGA_MEMORY_SIZE / sizeof(uint64_t); ++j)
+          mappings[i][j] = c;
+        // Make sure the combined writes have all gone out.
+        asm volatile("sfence" ::: "memory");
+        cycles[i] += rdtsc() - start;
+      }
+    }
+    screen->clear();
+  }
+  printf("screen_fill: %zu bytes: uncached %lu cycles, write-combining %lu "
+         "cycles\n",
+         vga::VGA_MEMORY_SIZE, cycles[0] / ROUNDS, cycles[1] / ROUNDS);
+}
+
+struct benchmark {
+  const char *name;
+  void (*run)();
+  const char *description;
+};
+
+static const benchmark benchmarks[] = {
+    {"alloc_latency", alloc_latency,
+     "page allocator alloc/free latency vs. live allocations"},
+    {"realloc_growth", realloc_growth,
+     "growing a buffer with realloc vs. alloc+copy+free"},
+    {"free_large", free_large,
+     "freeing multi-page allocations with batched TLB invalidation"},
+    {"context_switch", context_switch,
+     "switching address spaces with and without PCIDs"},
+    {"clone_latency", clone_latency,
+     "copy-on-write address space clones vs. resident pages"},
+    {"screen_fill", screen_fill,
+     "filling the VGA buffer uncached vs. write-combining"},
+};
+
+void run(const char *name) {
+  for (const auto &b : benchmarks) {
+    if (strcmp(name, b.name) == 0) {
+      printf("bench: running %s\n", b.name);
+      b.run();
+      return;
+    }
+  }
+  puts("benchmarks:");
+  for (const auto &b : benchmarks)
+    printf("  %s: %s\n", b.name, b.description);
+}
+
+} // namespace bench
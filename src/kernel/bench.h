@@ -0,0 +1,14 @@
+#ifndef KERNEL_BENCH_H
+#define KERNEL_BENCH_H
+
+// In-kernel microbenchmarks, run from the minishell with `bench <name>`.
+// Timings are reported in TSC cycles.
+namespace bench {
+
+// Runs the benchmark called `name`. If there's no such benchmark, lists the
+// available ones instead.
+void run(const char *name);
+
+} // namespace bench
+
+#endif
@@ -133,16 +133,9 @@ void dump_dir(const char *path) {
   }
 }
 
-kstd::unique_ptr<char> read_file(const char *path) {
-  assert(bpb && "must have bios param block to read files!");
-  assert(fat && "must have fat storage to read files!");
-  const directory_entry *file_entry = resolve_path(path);
-  if (!file_entry)
-    return nullptr;
-
-  fprintf(stderr, "fs: reading file: %s (%dB)", path, file_entry->size);
-
-  auto buffer = alloc::array_of<char>(file_entry->size);
+// Reads the clusters of `file_entry` into `buffer`, which must have room for
+// the file's size rounded up to a whole sector.
+static void read_file_into(const directory_entry *file_entry, char *buffer) {
   const uint16_t first_fat_sector = bpb->num_of_reserved_sectors;
   const uint16_t num_of_fat_sectors = bpb->sectors_per_fat * bpb->num_of_fats;
   const uint16_t size_of_root_dir =
@@ -173,7 +166,38 @@ kstd::unique_ptr<char> read_file(const char *path) {
     uint16_t fat_value = *(uint16_t *)(&fat[entry_offset]);
     cluster = (cluster & 1) ? fat_value >> 4 : fat_value & 0x0FFF;
   }
+}
+
+static const directory_entry *lookup_file_for_read(const char *path) {
+  assert(bpb && "must have bios param block to read files!");
+  assert(fat && "must have fat storage to read files!");
+  const directory_entry *file_entry = resolve_path(path);
+  if (file_entry)
+    fprintf(stderr, "fs: reading file: %s (%dB)", path, file_entry->size);
+  return file_entry;
+}
+
+kstd::unique_ptr<char> read_file(const char *path) {
+  const directory_entry *file_entry = lookup_file_for_read(path);
+  if (!file_entry)
+    return nullptr;
 
+  auto buffer = alloc::array_of<char>(file_entry->size);
+  read_file_into(file_entry, buffer);
   return kstd::unique_ptr<char>(buffer);
 }
+
+char *read_file(const char *path, kstd::arena &arena) {
+  const directory_entry *file_entry = lookup_file_for_read(path);
+  if (!file_entry)
+    return nullptr;
+
+  // Sectors are always read whole, and callers get a NUL-terminated buffer.
+  const auto buffer_size =
+      kstd::align_to(file_entry->size, kstd::Align{BYTES_PER_SECTOR}) + 1;
+  auto buffer = arena.array_of<char>(buffer_size);
+  read_file_into(file_entry, buffer);
+  buffer[file_entry->size] = '\0';
+  return buffer;
+}
 } // namespace fs
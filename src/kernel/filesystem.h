@@ -1,6 +1,7 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include "util/arena.h"
 #include "util/unique_ptr.h"
 #include <stdint.h>
 
@@ -81,6 +82,8 @@ void init();
 // Tries to read the contents of the file at `path` into an allocated buffer of
 // sufficient size. If reading the file fails, returns `nullptr`.
 kstd::unique_ptr<char> read_file(const char *path);
+// Same as above, but the buffer is allocated from `arena` and NUL-terminated.
+char *read_file(const char *path, kstd::arena &arena);
 
 void dump_dir(const char *path);
 
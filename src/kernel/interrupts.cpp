@@ -1,5 +1,6 @@
 #include "interrupts.h"
 
+#include "alloc.h"
 #include "debug.h"
 #include "floppy.h"
 #include "gdt.h"
@@ -163,6 +164,33 @@ void page_fault_handler_impl(interrupt_frame *frame, size_t error_code) {
   void *fault_address;
   asm volatile("mov %%cr2, %0" : "=r"(fault_address));
   const auto access_was_read = (error_code & (1 << 1)) == 0;
+  const auto access_was_user = (error_code & (1 << 2)) != 0;
+  const auto page_was_present = (error_code & (1 << 0)) != 0;
+
+  // Reserved kernel memory is committed on first touch. Unlike this file, the
+  // allocator is free to use SSE, so the interrupted code's FPU state has to
+  // be saved around the call.
+  if (!access_was_user) {
+    scheduler::fxsave_data fpu_state;
+    asm volatile("fxsave %0" : "=m"(fpu_state) : : "memory");
+    const bool handled =
+        alloc::handle_page_fault(fault_address, !access_was_read);
+    asm volatile("fxrstor %0" : : "m"(fpu_state) : "memory");
+    if (handled)
+      return;
+  }
+
+  // Writes to pages shared copy-on-write, whether by the task itself or by
+  // the kernel on its behalf, get a copy of the page.
+  if (!access_was_read && page_was_present) {
+    scheduler::fxsave_data fpu_state;
+    asm volatile("fxsave %0" : "=m"(fpu_state) : : "memory");
+    const bool handled = alloc::handle_copy_on_write_fault(fault_address);
+    asm volatile("fxrstor %0" : : "m"(fpu_state) : "memory");
+    if (handled)
+      return;
+  }
+
   const auto action = access_was_read ? "reading from" : "writing to";
   char buffer[512];
   snprintf(buffer, 64, "Page fault occurred %s 0x%p", action, fault_address);
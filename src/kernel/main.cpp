@@ -18,6 +18,7 @@
 #include "thunk.h"
 #include "timing.h"
 #include "vga.h"
+#include "zero_pool.h"
 
 #include "libadt/hash_map.h"
 
@@ -40,6 +41,7 @@ void kmain(const boot_info &b) {
   memory::early_init(boot.memory_map_base, boot.num_memory_map_entries);
   paging::early_init();
   low_memory::init(boot.avail_low_mem_start, boot.avail_low_mem_end);
+  paging::map_physical_memory();
 
   // Need to put this here so it doesn't get corrupted
   // TODO: why does finishing paging init clobber the kernel image?
@@ -57,12 +59,14 @@ void kmain(const boot_info &b) {
 
   vga::init();
   acpi::init();
+  memory::reclaim_boot_memory(boot);
 
   assert(memcmp(CANARY_BEGIN, "KERNEL START", sizeof(CANARY_BEGIN)) == 0);
   assert(memcmp(CANARY_END, "KERNEL END", sizeof(CANARY_END)) == 0);
 
   cmos::init();
   scheduler::init();
+  zero_pool::start();
   init_timer();
   puts("timer:     initialized");
   init_floppy_driver(boot.drive_number);
@@ -1,10 +1,13 @@
 #include "memory.h"
 
 #include "alloc.h"
+#include "main.h"
+#include "mutex.h"
 #include "pma.h"
 #include "util.h"
 #include "vma.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <stddef.h>
 
@@ -15,6 +18,9 @@ static void dump_memory_map();
 
 uint32_t g_num_of_memory_map_entries = 0;
 memory_map g_memory_map;
+// The memory map as the firmware reported it, before anything was marked
+// unusable.
+static memory_map g_firmware_memory_map;
 
 void early_init(uint32_t memory_map_base, uint32_t num_memory_map_entries) {
   assert(num_memory_map_entries < MAX_MEMORY_MAP_ENTRIES &&
@@ -22,6 +28,8 @@ void early_init(uint32_t memory_map_base, uint32_t num_memory_map_entries) {
   memcpy(&g_memory_map, reinterpret_cast<memory_map *>(memory_map_base),
          sizeof(memory_map_entry) * num_memory_map_entries);
   g_num_of_memory_map_entries = num_memory_map_entries;
+  memcpy(&g_firmware_memory_map, &g_memory_map,
+         sizeof(memory_map_entry) * num_memory_map_entries);
 
   sort_memory_map();
 }
@@ -38,6 +46,56 @@ memory_map &get_memory_map() {
   return g_memory_map;
 }
 
+size_t get_num_memory_map_entries() { return g_num_of_memory_map_entries; }
+
+const memory_map &get_firmware_memory_map() { return g_firmware_memory_map; }
+
+// Frees whatever part of [start, end) the firmware said was usable.
+static size_t reclaim_usable_range(uintptr_t start, uintptr_t end) {
+  size_t pages = 0;
+  for (auto i = 0u; i < g_num_of_memory_map_entries; ++i) {
+    const auto &entry = g_firmware_memory_map[i];
+    if (entry.type != memory_map_entry::usable)
+      continue;
+    const auto from = std::max(start, entry.base);
+    const auto to = std::min(end, entry.base + entry.length);
+    if (from < to)
+      pages += pma::add_free_range(from, to - from);
+  }
+  return pages;
+}
+
+void reclaim_boot_memory(const boot_info &boot) {
+  const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+  const auto free_before = pma::get_free_page_count();
+
+  // Everything stage2 put below the low memory allocator's region (stage1 and
+  // 2 themselves, the memory map, the raw kernel image and the boot page
+  // tables), and its stack above it. The first page stays unmapped to catch
+  // null dereferences, and also holds the BIOS's data.
+  const auto low_pages =
+      reclaim_usable_range(PAGE_SIZE, boot.avail_low_mem_start) +
+      reclaim_usable_range(boot.avail_low_mem_end, KERNEL_LMA_START);
+  // Nothing is ever loaded past the end of the kernel image.
+  const auto kernel_scratch_pages =
+      reclaim_usable_range(KERNEL_LMA_END, 0x300000);
+  // `acpi::init` is done with the tables by now.
+  size_t acpi_pages = 0;
+  for (auto i = 0u; i < g_num_of_memory_map_entries; ++i) {
+    const auto &entry = g_memory_map[i];
+    if (entry.type == memory_map_entry::reclaimable)
+      acpi_pages += pma::add_free_range(entry.base, entry.length);
+  }
+
+  printf("memory: reclaimed %lu KiB of low memory, %lu KiB after the kernel "
+         "and %lu KiB of ACPI tables\n",
+         low_pages * PAGE_SIZE / 1024, kernel_scratch_pages * PAGE_SIZE / 1024,
+         acpi_pages * PAGE_SIZE / 1024);
+  printf("memory: %lu KiB free before, %lu KiB after\n",
+         free_before * PAGE_SIZE / 1024,
+         pma::get_free_page_count() * PAGE_SIZE / 1024);
+}
+
 void sort_memory_map() {
   // Sort the physical memory map returned by the bootloader, putting the
   // largest usable regions first in our list
@@ -62,7 +120,10 @@ void sort_memory_map() {
     kstd::transform(
         g_memory_map, g_num_of_memory_map_entries, [=](auto &entry) {
           if ((uintptr_t)start <= entry.base && entry.base < (uintptr_t)end) {
-            entry.length -= end - entry.base;
+            // Entries entirely inside the range are left empty.
+            const auto overlap = std::min<uint64_t>(end - entry.base,
+                                                    entry.length);
+            entry.length -= overlap;
             entry.base = end;
             return true;
           }
@@ -72,7 +133,8 @@ void sort_memory_map() {
   // We can't actually use 0x0 - 0x500 because this memory is owned by the BIOS.
   mark_unusable(0x0, 0x500);
 
-  // The kernel is located from 0x100000 - 0x300000
+  // The kernel is located from 0x100000 - 0x200000. The next 1MiB is held back
+  // until `reclaim_boot_memory`.
   mark_unusable(0x100000, 0x300000);
 
   dump_memory_map();
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct boot_info;
+
 extern char __text_start__, __text_end__;
 extern char __rodata_start__, __rodata_end__;
 extern char __data_start__, __data_end__;
@@ -14,6 +16,23 @@ namespace memory {
 // 4KiB pages
 constexpr static size_t PAGE_SIZE = 0x1000;
 constexpr static auto PAGE_ALIGN = kstd::Align{PAGE_SIZE};
+// 2MiB pages, mapped by a single PML2 entry
+constexpr static size_t HUGE_PAGE_SIZE = 0x200000;
+constexpr static auto HUGE_PAGE_ALIGN = kstd::Align{HUGE_PAGE_SIZE};
+constexpr static size_t PAGES_PER_HUGE_PAGE = HUGE_PAGE_SIZE / PAGE_SIZE;
+// 1GiB pages, mapped by a single PML3 entry, where the CPU supports them
+constexpr static size_t GIANT_PAGE_SIZE = 0x40000000;
+
+// Zeroes `n` whole pages starting at `page`. Unlike the libc memset, this
+// doesn't touch any SSE state, and `rep stosq` lets the CPU clear full lines
+// without reading them first.
+inline void zero_pages(void *page, size_t n) {
+  size_t count = n * PAGE_SIZE / sizeof(uint64_t);
+  asm volatile("rep stosq"
+               : "+D"(page), "+c"(count)
+               : "a"(0)
+               : "memory");
+}
 
 constexpr static ptrdiff_t KERNEL_SIZE = 0x100 * PAGE_SIZE;
 constexpr static ptrdiff_t KERNEL_VMA_OFFSET = 0xFFFFFFFF80000000;
@@ -22,6 +41,33 @@ constexpr static uintptr_t KERNEL_LMA_END = KERNEL_LMA_START + KERNEL_SIZE;
 constexpr static uintptr_t KERNEL_VMA_START = KERNEL_LMA_START + KERNEL_VMA_OFFSET;
 constexpr static uintptr_t KERNEL_VMA_END = KERNEL_VMA_START + KERNEL_SIZE;
 
+// The bottom of the kernel's half of the address space is split into fixed
+// regions, one per kind of mapping, so they don't fragment each other and
+// each kind shares its own page tables.
+//
+// 1TiB for mapping all of physical memory.
+constexpr static uintptr_t PHYSMAP_START = 0xFFFFFC0000000000;
+constexpr static uintptr_t PHYSMAP_END = 0xFFFFFD0000000000;
+// 1TiB for the kernel heap.
+constexpr static uintptr_t HEAP_START = 0xFFFFFD0000000000;
+constexpr static uintptr_t HEAP_END = 0xFFFFFE0000000000;
+// 512GiB of fixed-size kernel stack slots.
+constexpr static uintptr_t STACKS_START = 0xFFFFFE0000000000;
+constexpr static uintptr_t STACKS_END = 0xFFFFFE8000000000;
+// 512GiB for device memory.
+constexpr static uintptr_t MMIO_START = 0xFFFFFE8000000000;
+constexpr static uintptr_t MMIO_END = 0xFFFFFF0000000000;
+
+// Where physical RAM can be reached through the physmap, once the kernel's
+// page tables are live.
+inline void *phys_to_virt(uintptr_t physical_address) {
+  return (void *)(PHYSMAP_START + physical_address);
+}
+// The physical address behind a pointer into the physmap.
+inline uintptr_t virt_to_phys(const volatile void *p) {
+  return (uintptr_t)p - PHYSMAP_START;
+}
+
 struct memory_map_entry {
   enum type : uint32_t {
     usable = 1,
@@ -59,6 +105,14 @@ using memory_map = memory_map_entry[MAX_MEMORY_MAP_ENTRIES];
 void early_init(uint32_t memory_map_base, uint32_t num_memory_map_entries);
 void finish_init();
 memory_map &get_memory_map();
+// The memory map as the firmware reported it, before it was sorted and the
+// kernel's own memory was taken out of it.
+const memory_map &get_firmware_memory_map();
+size_t get_num_memory_map_entries();
+// Gives the physical memory that was only needed during boot to the pma: what
+// the bootloader left in low memory, the scratch space after the kernel image,
+// and ACPI-reclaimable ranges. Must run after `acpi::init`.
+void reclaim_boot_memory(const boot_info &boot);
 } // namespace memory
 
 #endif
@@ -2,8 +2,11 @@
 
 #include "libadt/array.h"
 
+#include "alloc.h"
+#include "bench.h"
 #include "filesystem.h"
 #include "input.h"
+#include "util/arena.h"
 #include "util/io.h"
 #include "paging.h"
 #include "scheduler.h"
@@ -17,6 +20,8 @@ namespace minishell {
 static adt::array<char, 0x100> command_buffer;
 static unsigned buffer_count = 0;
 static bool shift_held = false;
+// Scratch memory for the command being run, released once it finishes.
+static kstd::arena command_arena;
 constexpr unsigned char UPPERS[256] = {
     0x0,  0x1,  0x2,  0x3,  0x4,  0x5,  0x6,  0x7,  0x8,  0x9,  0xa,  0xb,
     0xc,  0xd,  0xe,  0xf,  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
@@ -70,20 +75,28 @@ static void handle_key_event(keyboard::event e) {
   command_buffer[std::min(buffer_count, 0xFFu)] = '\0';
 
   if (strcmp(command_buffer, "help") == 0) {
-    vga::string::puts("commands: help, clear, pages, ls, shutdown(q)");
+    vga::string::puts("commands: help, clear, pages, heap, bench, ls, shutdown(q)");
   } else if (strcmp(command_buffer, "clear") == 0) {
     vga::current_screen.lock()->clear();
   } else if (strcmp(command_buffer, "pages") == 0) {
     paging::kernel_page_tables.dump_to_file(stdout);
+  } else if (strcmp(command_buffer, "heap") == 0) {
+    alloc::dump_stats(stdout);
+  } else if (strcmp(command_buffer, "heap trace") == 0) {
+    alloc::dump_trace(stdout);
+  } else if (strcmp(command_buffer, "bench") == 0) {
+    bench::run("");
+  } else if (strncmp(command_buffer, "bench ", strlen("bench ")) == 0) {
+    bench::run(&command_buffer[strlen("bench ")]);
   } else if (strcmp(command_buffer, "ls") == 0) {
     fs::dump_dir("/");
   } else if (strncmp(command_buffer, "cat ", strlen("cat ")) == 0) {
     const char *path = &command_buffer[strlen("cat ")];
-    const auto contents = fs::read_file(path);
+    const auto contents = fs::read_file(path, command_arena);
     if (!contents)
       printf("Can't find file with path: `%s`\n", path);
     else
-      vga::string::puts(contents.get());
+      vga::string::puts(contents);
   } else if (strcmp(command_buffer, "shutdown") == 0 ||
              strcmp(command_buffer, "q") == 0) {
     // QEMU magic shutdown
@@ -101,6 +114,7 @@ static void handle_key_event(keyboard::event e) {
   }
 
   // clear command buffer
+  command_arena.reset();
   command_buffer.clear();
   buffer_count = 0;
   vga::string::print("> ");
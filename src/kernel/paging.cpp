@@ -1,11 +1,14 @@
 #include "paging.h"
 
+#include "low_memory_allocator.h"
 #include "memory.h"
 #include "util.h"
 #include "pma.h"
 #include "vma.h"
 #include "panic.h"
+#include "zero_pool.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <string.h>
 
@@ -14,11 +17,118 @@ using namespace memory;
 namespace paging {
 
 page_tables kernel_page_tables;
+bool physmap_ready = false;
+
+static page_tables *current_tables = &kernel_page_tables;
+// Bumped whenever a table in the kernel's half of the address space is freed.
+static uint64_t kernel_tlb_generation = 0;
+static bool pcid_enabled = false;
+bool use_pcid = true;
+
+static bool is_kernel_address(uintptr_t virtual_page) {
+  return (intptr_t)virtual_page < 0;
+}
+
+// Kernel mappings are global, so `invlpg` drops them from every PCID. Cached
+// paging structures never are though, so when a kernel table goes away, other
+// PCIDs may still have it cached until they're next flushed.
+static void kernel_table_freed(uintptr_t virtual_page) {
+  if (!is_kernel_address(virtual_page))
+    return;
+  kernel_tlb_generation += 1;
+  current_tables->tlb_generation = kernel_tlb_generation;
+}
+
+// Mappings in the kernel's half are the same in every address space.
+static uintptr_t with_global(uintptr_t virtual_page, attributes attrs) {
+  return is_kernel_address(virtual_page) ? attrs | attributes::GLOBAL
+                                         : (uintptr_t)attrs;
+}
+
+// Where the PAT bit is in a PML1 entry, since bit 12 is part of the address.
+constexpr static uint64_t PML1_PAT = 1ULL << 7;
+
+static uint64_t to_pml1_attributes(uint64_t attrs) {
+  return (attrs & attributes::PAT) ? (attrs & ~attributes::PAT) | PML1_PAT
+                                   : attrs;
+}
+
+static uint64_t from_pml1_attributes(uint64_t entry) {
+  return (entry & PML1_PAT) ? (entry & ~PML1_PAT) | attributes::PAT : entry;
+}
 
 static void invlpg(uintptr_t page) {
   asm volatile("invlpg (%0)" ::"r"(page) : "memory");
 }
 
+// Flushes the current PCID's TLB entries, except for global ones.
+static void flush_tlb() {
+  uint64_t cr3;
+  asm volatile("mov %%cr3, %0\n"
+               "mov %0, %%cr3"
+               : "=r"(cr3)
+               :
+               : "memory");
+}
+
+// Flushes every TLB entry, global ones included, for every PCID.
+static void flush_global_tlb() {
+  constexpr uint64_t CR4_PGE = 1 << 7;
+  uint64_t cr4;
+  asm volatile("mov %%cr4, %0\n"
+               "xor %1, %0\n"
+               "mov %0, %%cr4\n"
+               "xor %1, %0\n"
+               "mov %0, %%cr4"
+               : "=&r"(cr4)
+               : "r"(CR4_PGE)
+               : "memory");
+  // That covers cached paging structures too.
+  current_tables->tlb_generation = kernel_tlb_generation;
+}
+
+size_t tlb_full_flush_threshold = 32;
+
+void tlb_batch::invalidate(uintptr_t virtual_page) {
+  // With a threshold too high to ever reach, flush each time the batch fills
+  // up instead.
+  if (num_pages == MAX_PAGES && tlb_full_flush_threshold >= MAX_PAGES)
+    flush();
+  if (num_pages < MAX_PAGES)
+    pages[num_pages] = virtual_page;
+  num_pages += 1;
+  has_global_pages |= is_kernel_address(virtual_page);
+}
+
+void tlb_batch::free_after_flush(uintptr_t physical_page, size_t n) {
+  if (num_frees == MAX_FREES)
+    flush();
+  frees[num_frees++] = pending_free{physical_page, n};
+}
+
+void tlb_batch::flush() {
+  if (num_pages > tlb_full_flush_threshold) {
+    if (has_global_pages)
+      flush_global_tlb();
+    else
+      flush_tlb();
+  } else {
+    for (size_t i = 0; i < num_pages; ++i)
+      invlpg(pages[i]);
+  }
+  num_pages = 0;
+  has_global_pages = false;
+
+  for (size_t i = 0; i < num_frees; ++i) {
+    if (frees[i].n == 1)
+      pma::free_physical_page((void *)frees[i].physical_page);
+    else
+      pma::free_contiguous_physical_pages(frees[i].physical_page,
+                                          frees[i].n);
+  }
+  num_frees = 0;
+}
+
 // 1 PML4, 1 PML3, 1 PML2, 1 PML1
 //  - 4 pages of kernel address space needed
 //  - (2MB of kernel address space)
@@ -30,28 +140,100 @@ alignas(PAGE_ALIGN.val) page_table identity_pml3 = {0};
 alignas(PAGE_ALIGN.val) page_table identity_pml2 = {0};
 alignas(PAGE_ALIGN.val) page_table identity_pml1 = {0};
 
-constexpr static auto MAX_STATIC_TABLES = 8;
+constexpr static auto MAX_STATIC_TABLES = 16;
 alignas(PAGE_ALIGN.val) page_table static_tables[MAX_STATIC_TABLES] = {{0}};
 uint64_t num_static_tables_left = MAX_STATIC_TABLES;
 
-constexpr static auto MAX_DYNAMIC_TABLES = 512;
-page_table *dynamic_tables = nullptr;
-uint64_t num_dynamic_tables_left = 0;
+// Tables that have been freed and cleared, ready to be handed out again.
+// Linked through their first entry, by physical address.
+static uintptr_t zeroed_tables = 0;
+static size_t num_zeroed_tables = 0;
+constexpr static size_t MAX_ZEROED_TABLES = 64;
+
+// Whether the CPU can map 1GiB pages with PML3 entries.
+static bool giant_pages_supported = false;
+
+static bool is_counted(uintptr_t table) {
+  return pma::physical_memory_allocator_available &&
+         pma::page_of(table).owner == pma::page_owner::page_tables;
+}
+
+// Pins are counted along with a table's live entries, above the bits the
+// entries themselves can reach, so a pinned table never looks empty.
+constexpr static int TABLE_PIN = 1 << 16;
+
+void count_live_entries(uintptr_t table, int delta) {
+  if (!is_counted(table))
+    return;
+  auto &page = pma::page_of(table);
+  assert((delta >= 0 || page.live_entries >= (uint32_t)-delta) &&
+         "page table has fewer live entries than that!");
+  page.live_entries += delta;
+  assert(page.live_entries % TABLE_PIN <= NUM_PAGE_TABLE_ENTRIES &&
+         "page table has more live entries than entries!");
+}
+
+bool table_is_empty(uintptr_t table) {
+  return is_counted(table) && pma::page_of(table).live_entries == 0;
+}
+
+static void push_zeroed_table(uintptr_t table) {
+  auto *entries = (page_table *)table_address(table);
+  (*entries)[0] = zeroed_tables;
+  zeroed_tables = table;
+  num_zeroed_tables += 1;
+}
+
+// Gets a fresh table from the pma, preferably one the zero pool has already
+// cleared. Only clears it here if the pool has run dry.
+static uintptr_t new_zeroed_table() {
+  uintptr_t table;
+  if (const auto page = zero_pool::take()) {
+    table = *page;
+  } else {
+    table = pma::get_physical_page();
+    memory::zero_pages(memory::phys_to_virt(table), 1);
+  }
+  auto &page = pma::page_of(table);
+  page.owner = pma::page_owner::page_tables;
+  page.live_entries = 0;
+  return table;
+}
+
+// Takes back a table that's no longer referenced from anywhere, once the TLB
+// can't have anything cached from it either. Its entries may still have bits
+// set, just not PRESENT.
+static void release_page_level(uintptr_t table) {
+  memory::zero_pages((void *)table_address(table), 1);
+  if (is_counted(table))
+    pma::page_of(table).live_entries = 0;
+  if (num_zeroed_tables < MAX_ZEROED_TABLES || !is_counted(table))
+    push_zeroed_table(table);
+  else
+    pma::free_physical_page((void *)table);
+}
 
 static uintptr_t allocate_page_level() {
+  if (zeroed_tables) {
+    const auto table = zeroed_tables;
+    auto *entries = (page_table *)table_address(table);
+    zeroed_tables = (*entries)[0];
+    num_zeroed_tables -= 1;
+    (*entries)[0] = 0;
+    return table;
+  }
+  if (pma::physical_memory_allocator_available)
+    return new_zeroed_table();
+  // Until the kernel's tables are live, low memory is reachable through the
+  // boot tables. Use it, to save the static tables for later.
+  if (!physmap_ready)
+    return (uintptr_t)low_memory::allocate(PAGE_SIZE, PAGE_ALIGN);
+  // Between then and the pma being set up, there are the static tables.
   if (num_static_tables_left > 0) {
     page_table *next_static_table =
         &static_tables[--num_static_tables_left];
     return (uintptr_t)next_static_table - KERNEL_VMA_OFFSET;
   }
-  assert(
-      dynamic_tables &&
-      "ran out of static tables before dynamic tables could be initialized!");
-  if (num_dynamic_tables_left > 0) {
-    page_table *next_dynamic_table =
-        &dynamic_tables[--num_dynamic_tables_left];
-    return (uintptr_t)next_dynamic_table - KERNEL_VMA_OFFSET;
-  }
   kstd::panic("no more page tables!");
 }
 
@@ -65,8 +247,8 @@ void early_init() {
   kernel_pml2[0] = ((uintptr_t)&kernel_pml1 - KERNEL_VMA_OFFSET) |
                    attributes::RW | attributes::PRESENT;
   for (unsigned i = 0x100; i < 0x200; ++i) {
-    kernel_pml1[i] =
-        ((uintptr_t)i * PAGE_SIZE) | attributes::XD | attributes::PRESENT;
+    kernel_pml1[i] = ((uintptr_t)i * PAGE_SIZE) | attributes::XD |
+                     attributes::GLOBAL | attributes::PRESENT;
   }
 
   // Identity map the bottom 2M of memory as read-only
@@ -85,6 +267,52 @@ void early_init() {
 
   kernel_page_tables.base = &kernel_pml4;
   kernel_page_tables.allocate = &allocate_page_level;
+
+  // CPUID.80000001h:EDX.Page1GB
+  giant_pages_supported = cpuid(0x80000001).edx & (1 << 26);
+}
+
+void map_physical_memory() {
+  // Only RAM goes in: mapping MMIO or holes write-back could have the CPU
+  // cache (or speculatively read) things it shouldn't.
+  struct range {
+    uintptr_t start;
+    uintptr_t end;
+  };
+  range ranges[memory::MAX_MEMORY_MAP_ENTRIES];
+  int num_ranges = 0;
+  const auto &map = memory::get_firmware_memory_map();
+  for (size_t i = 0; i < memory::get_num_memory_map_entries(); ++i) {
+    const auto &entry = map[i];
+    if (entry.type != memory::memory_map_entry::usable &&
+        entry.type != memory::memory_map_entry::reclaimable &&
+        entry.type != memory::memory_map_entry::nvs)
+      continue;
+    const auto start = kstd::align_to(entry.base, PAGE_ALIGN);
+    const auto end = (entry.base + entry.length) & -PAGE_SIZE;
+    if (start < end)
+      ranges[num_ranges++] = range{start, end};
+  }
+  kstd::insertion_sort(ranges, num_ranges, [](const range &lhs,
+                                              const range &rhs) {
+    return lhs.start < rhs.start;
+  });
+
+  size_t total = 0;
+  for (int i = 0; i < num_ranges;) {
+    auto [start, end] = ranges[i++];
+    // Merge ranges that touch, so they can share large pages.
+    for (; i < num_ranges && ranges[i].start <= end; ++i)
+      end = std::max(end, ranges[i].end);
+    if (end > memory::PHYSMAP_END - memory::PHYSMAP_START)
+      kstd::panic("physical memory doesn't fit in the physmap!");
+    kernel_page_tables.map_range(start, end, memory::phys_to_virt(start),
+                                 memory::phys_to_virt(end),
+                                 attributes::RW | attributes::XD);
+    total += end - start;
+  }
+  printf("Paging init: mapped %zu MiB of RAM into the physmap\n",
+         total / (1024 * 1024));
 }
 
 static uint64_t readmsr(uint32_t n) {
@@ -99,6 +327,40 @@ static void writesmr(uint32_t n, uint64_t val) {
   asm("wrmsr" ::"c"(n), "d"(hi), "a"(lo));
 }
 
+// Memory types, as encoded in the PAT.
+enum memory_type : uint8_t {
+  MEMORY_TYPE_UC = 0x00,
+  MEMORY_TYPE_WC = 0x01,
+  MEMORY_TYPE_WT = 0x04,
+  MEMORY_TYPE_WB = 0x06,
+  MEMORY_TYPE_UC_MINUS = 0x07,
+};
+
+// Indexed by PAT << 2 | CACHE_DISABLE << 1 | WRITE_THROUGH. The first four are
+// what the PAT resets to, so entries that only use WRITE_THROUGH and
+// CACHE_DISABLE mean the same as before it's programmed. WRITE_COMBINING takes
+// the fifth.
+constexpr static memory_type pat_entries[8] = {
+    MEMORY_TYPE_WB, MEMORY_TYPE_WT, MEMORY_TYPE_UC_MINUS, MEMORY_TYPE_UC,
+    MEMORY_TYPE_WC, MEMORY_TYPE_WT, MEMORY_TYPE_UC_MINUS, MEMORY_TYPE_UC,
+};
+
+static unsigned pat_index(uint64_t attrs) {
+  return ((attrs & attributes::PAT) ? 4 : 0) |
+         ((attrs & attributes::CACHE_DISABLE) ? 2 : 0) |
+         ((attrs & attributes::WRITE_THROUGH) ? 1 : 0);
+}
+
+static void program_pat() {
+  uint64_t pat = 0;
+  for (unsigned i = 0; i < 8; ++i)
+    pat |= (uint64_t)pat_entries[i] << (i * 8);
+  // Nothing can be cached under the old memory types once they change. Every
+  // x86-64 CPU has a PAT, so there's no need to check for one.
+  asm volatile("wbinvd" ::: "memory");
+  writesmr(0x277, pat);
+}
+
 void enable_kernel_page_protection(uintptr_t kernel_stack_base) {
   // Enable XD (execute-disable bit) for pages
   const auto efer = readmsr(0xC0000080);
@@ -115,36 +377,14 @@ void enable_kernel_page_protection(uintptr_t kernel_stack_base) {
 
   // Set up appropriate page permissions for the various segments linked into
   // the kernel
-  for (char *c = &__text_start__; c != &__text_end__; c += PAGE_SIZE) {
-    auto entry = kernel_page_tables.find(c);
-    assert(entry != page_tables::iterator::end() && entry.exists() &&
-           "no text page mapped?");
-    assert(entry.present() && "text page not present?");
-    *entry &= ~(attributes::XD | attributes::RW);
-  }
-
-  for (char *c = &__rodata_start__; c != &__rodata_end__; c += PAGE_SIZE) {
-    auto entry = kernel_page_tables.find(c);
-    assert(entry != page_tables::iterator::end() && entry.exists() &&
-           "no rodata page mapped?");
-    assert(entry.present() && "rodata page not present?");
-    *entry = (*entry | attributes::XD) & ~attributes::RW;
-  }
-
-  for (char *c = &__data_start__; c != &__data_end__; c += PAGE_SIZE) {
-    auto entry = kernel_page_tables.find(c);
-    assert(entry != page_tables::iterator::end() && entry.exists() &&
-           "no data page mapped?");
-    assert(entry.present() && "data page not present?");
-    *entry |= (uintptr_t)(attributes::XD | attributes::RW);
-  }
-
-  for (char *c = &__bss_start__; c != &__bss_end__; c += PAGE_SIZE) {
-    auto entry = kernel_page_tables.find(c);
-    assert(entry != page_tables::iterator::end() && "no bss page mapped?");
-    assert(entry.present() && "bss page not present?");
-    *entry |= (uintptr_t)(attributes::XD | attributes::RW);
-  }
+  kernel_page_tables.protect_range(&__text_start__, &__text_end__,
+                                   attributes::NONE);
+  kernel_page_tables.protect_range(&__rodata_start__, &__rodata_end__,
+                                   attributes::XD);
+  kernel_page_tables.protect_range(&__data_start__, &__data_end__,
+                                   attributes::XD | attributes::RW);
+  kernel_page_tables.protect_range(&__bss_start__, &__bss_end__,
+                                   attributes::XD | attributes::RW);
 
   // Give ourselves 10 pages (40KiB) worth of stack.
   constexpr static auto KERNEL_STACK_SIZE = 0x10 * PAGE_SIZE;
@@ -192,26 +432,46 @@ void enable_kernel_page_protection(uintptr_t kernel_stack_base) {
                :
                : "r"((uintptr_t)&kernel_pml4 - KERNEL_VMA_OFFSET)
                : "memory");
+  physmap_ready = true;
+
+  // Loading CR3 flushed anything the boot page tables had in the TLB under the
+  // old memory types, and nothing global is in there yet.
+  program_pat();
+
+  // Kernel mappings have been marked global all along, but that only takes
+  // effect with CR4.PGE set.
+  asm volatile("mov %%cr4, %0\n"
+               "or %c1, %0\n"
+               "mov %0, %%cr4"
+               : "=&r"(tmp)
+               : "i"(1 << 7));
+
+  // CPUID.01h:ECX.PCID. CR4.PCIDE can only be set while CR3 holds PCID 0,
+  // which the kernel's page tables keep.
+  if (cpuid(1).ecx & (1 << 17)) {
+    asm volatile("mov %%cr4, %0\n"
+                 "or %1, %0\n"
+                 "mov %0, %%cr4"
+                 : "=&r"(tmp)
+                 : "r"((int64_t)1 << 17));
+    pcid_enabled = true;
+  }
 
   puts("Paging init: all kernel pages now protected");
 }
 
 void finish_init() {
-  const auto physical_pages =
-      pma::get_contiguous_physical_pages(MAX_DYNAMIC_TABLES);
-  void *virtual_addr = kernel_page_tables.identity_map_pages_into_kernel_space(
-      physical_pages, MAX_DYNAMIC_TABLES);
-  dynamic_tables = (page_table *)virtual_addr;
-  memset((void *)dynamic_tables, 0, sizeof(page_table) * MAX_DYNAMIC_TABLES);
-  num_dynamic_tables_left = MAX_DYNAMIC_TABLES;
-  vma::remove_from_free_list(virtual_addr,
-                             sizeof(page_table) * MAX_DYNAMIC_TABLES);
-  uint64_t dummy;
-  asm volatile("mov %%cr3, %0\n"
-               "mov %0, %%cr3"
-               : "=r"(dummy)
-               :
-               : "memory");
+  // User address spaces get a copy of the kernel's half of the PML4, so all
+  // of the kernel's PML3 tables have to exist before any of them do. They're
+  // never freed, so the copies stay valid.
+  auto it = page_tables::iterator(kernel_page_tables.base,
+                                  (void *)memory::PHYSMAP_START);
+  for (; it != page_tables::iterator::end(); ++it) {
+    if (!it.present()) {
+      it.allocate_and_descend(&allocate_page_level);
+      it.ascend();
+    }
+  }
 }
 
 #if 0
@@ -276,13 +536,14 @@ get_page_entry_info(page_tables &tables, uintptr_t virtual_page_address,
 
 uintptr_t page_tables::get_physical_address(void *virtual_addr) const {
   const auto page_addr = (uintptr_t)virtual_addr & -PAGE_SIZE;
-  const auto offset_in_page = (uintptr_t)virtual_addr - page_addr;
   const auto entry = find((void*)page_addr);
   assert(entry != page_tables::iterator::end() &&
          "couldn't find an entry for address!");
   if (!entry.present())
     fprintf(stderr, "entry not present for addr %p\n", virtual_addr);
   assert(entry.present() && "entry not found!");
+  const auto offset_in_page =
+      (uintptr_t)virtual_addr & (entry.page_size() - 1);
   return entry.physical_page_address() + offset_in_page;
 }
 
@@ -298,17 +559,45 @@ void *page_tables::map_range(uintptr_t physical_start, uintptr_t physical_end,
   assert((physical_end - physical_start) ==
              ((uintptr_t)virtual_end - (uintptr_t)virtual_start) &&
          "physical and virtual address range sizes must match!");
-  auto it = get(virtual_start);
+  const auto fits = [&](uintptr_t v, uintptr_t p, size_t page_size) {
+    return v % page_size == 0 && p % page_size == 0 &&
+           (uintptr_t)virtual_end - v >= page_size;
+  };
+
   auto v = reinterpret_cast<uintptr_t>(virtual_start);
-  for (auto p = physical_start; p < physical_end;
-       p += PAGE_SIZE, v += PAGE_SIZE) {
-    assert(it.virtual_page_address() == v &&
-           "iterator and virtual address out of sync!");
-    map_page(p, it, attrs);
-    while (++it == page_tables::iterator::end(it.level()))
-      it.ascend();
-    while (it.level() != 1)
-      it.allocate_and_descend(allocate);
+  auto p = physical_start;
+  while (p < physical_end) {
+    if (giant_pages_supported && fits(v, p, GIANT_PAGE_SIZE)) {
+      auto it = iterator(base, (void *)v);
+      while (it.level() != 3)
+        it.allocate_and_descend(allocate);
+      // Only take over entries that have never had anything under them, so
+      // there are no tables to clean up.
+      if (*it == 0) {
+        it.set(p | with_global(v, attrs) | attributes::HUGE |
+               attributes::PRESENT);
+        invlpg(v);
+        v += GIANT_PAGE_SIZE;
+        p += GIANT_PAGE_SIZE;
+        continue;
+      }
+    }
+    if (fits(v, p, HUGE_PAGE_SIZE)) {
+      map_huge_page(p, (void *)v, attrs);
+      v += HUGE_PAGE_SIZE;
+      p += HUGE_PAGE_SIZE;
+      continue;
+    }
+    // Use 4KiB pages up to the next 2MiB boundary. They're all in the same
+    // PML1 table, so the iterator never has to leave it.
+    const auto end = std::min((uintptr_t)virtual_end,
+                              kstd::align_to(v + 1, HUGE_PAGE_ALIGN));
+    for (auto it = get((void *)v); v < end;
+         ++it, v += PAGE_SIZE, p += PAGE_SIZE) {
+      assert(it.virtual_page_address() == v &&
+             "iterator and virtual address out of sync!");
+      map_page(p, it, attrs);
+    }
   }
   return virtual_start;
 }
@@ -346,13 +635,27 @@ void *page_tables::map_page(uintptr_t physical_page, page_tables::iterator it,
                 "Entry   :%lx\n",
                 (void *)virtual_page, (void *)physical_page, *it);
 
-  *it =
-      physical_page | (uintptr_t)attrs | (uintptr_t)attributes::PRESENT;
-
-  invlpg((uintptr_t)virtual_page);
+  // The entry wasn't present, so there's nothing in the TLB to invalidate:
+  // the CPU never caches translations that aren't present.
+  it.set(physical_page |
+         to_pml1_attributes(with_global((uintptr_t)virtual_page, attrs)) |
+         (uintptr_t)attributes::PRESENT);
   return virtual_page;
 }
 
+// Frees the tables the entry at `it` is in, and above, that clearing it left
+// empty, once `tlb` has been flushed. Tables hanging off the PML4 are kept
+// even when empty.
+static void release_empty_tables(page_tables::iterator it, tlb_batch &tlb) {
+  while (it.level() < 3 && table_is_empty(it.table())) {
+    const auto table = it.table();
+    it.ascend();
+    it.set(0);
+    kernel_table_freed(it.virtual_page_address());
+    tlb.free_after_flush(table, 1);
+  }
+}
+
 void page_tables::unmap_page(void *virtual_page) {
   assert((uintptr_t)virtual_page % memory::PAGE_SIZE == 0 &&
          "virtual address should be page-aligned!");
@@ -363,19 +666,232 @@ void page_tables::unmap_page(void *virtual_page) {
     kstd::panic("Tried to unmap non-present page\n"
                 "Virtual:%p",
                 (void *)virtual_page);
+  assert(!entry.huge() && "use unmap_huge_page to unmap huge pages!");
+
+  tlb_batch tlb;
+  entry.set(*entry & ~attributes::PRESENT);
+  tlb.invalidate((uintptr_t)virtual_page);
+  release_empty_tables(entry, tlb);
+}
+
+void page_tables::pin_tables(void *virtual_start, void *virtual_end) {
+  assert(allocate &&
+         "tried to allocate before table allocator was initialized!");
+  for (auto v = (uintptr_t)virtual_start & -HUGE_PAGE_SIZE;
+       v < (uintptr_t)virtual_end; v += HUGE_PAGE_SIZE) {
+    auto it = iterator(base, (void *)v);
+    while (it.level() != 1)
+      it.allocate_and_descend(allocate);
+    count_live_entries(it.table(), TABLE_PIN);
+  }
+}
+
+void page_tables::unpin_tables(void *virtual_start, void *virtual_end) {
+  tlb_batch tlb;
+  for (auto v = (uintptr_t)virtual_start & -HUGE_PAGE_SIZE;
+       v < (uintptr_t)virtual_end; v += HUGE_PAGE_SIZE) {
+    auto it = iterator(base, (void *)v);
+    while (it.descend())
+      ;
+    assert(it.level() == 1 && "unpinning tables that were never pinned?");
+    count_live_entries(it.table(), -TABLE_PIN);
+    release_empty_tables(it, tlb);
+  }
+}
 
-  *entry &= ~attributes::PRESENT;
+void page_tables::map_pinned_page(uintptr_t physical_page, void *virtual_page,
+                                  attributes attrs) {
+  auto it = find(virtual_page);
+  assert(it != iterator::end() && it.level() == 1 &&
+         "mapping a page in tables that weren't pinned?");
+  // Straight to the entry, rather than through `set`, to leave the count be.
+  *it = physical_page |
+        to_pml1_attributes(with_global((uintptr_t)virtual_page, attrs)) |
+        (uintptr_t)attributes::PRESENT;
   invlpg((uintptr_t)virtual_page);
 }
 
-void page_tables::unmap_range(void *virtual_start, void *virtual_end) {
-  assert((uintptr_t)virtual_start % memory::PAGE_SIZE == 0 &&
+void page_tables::count_pinned_page(void *virtual_page) {
+  count_live_entries(find(virtual_page).table(), 1);
+}
+
+void *page_tables::map_huge_page(uintptr_t physical_page, void *virtual_page,
+                                 attributes attrs) {
+  assert((uintptr_t)virtual_page % HUGE_PAGE_SIZE == 0 &&
+         "virtual address must be 2MiB-aligned!");
+  assert(physical_page % HUGE_PAGE_SIZE == 0 &&
+         "physical address must be 2MiB-aligned!");
+  assert(allocate &&
+         "tried to allocate before table allocator was initialized!");
+
+  auto it = iterator(base, virtual_page);
+  while (it.level() != 2)
+    it.allocate_and_descend(allocate);
+
+  if (it.present()) {
+    if (it.huge())
+      kstd::panic("Tried to map already-present huge page!\n"
+                  "Virtual :%p\n"
+                  "Physical:%p\n"
+                  "Entry   :%lx\n",
+                  virtual_page, (void *)physical_page, *it);
+    // A PML1 table is left over from earlier 4KiB mappings. As long as none
+    // of them are still present, the table can be swapped out for the huge
+    // page and reused elsewhere. Only tables from before the pma was set up
+    // have to be scanned to tell.
+    const auto table = *it & ADDRESS_MASK;
+    assert((!is_counted(table) ||
+            pma::page_of(table).live_entries < TABLE_PIN) &&
+           "can't map a huge page over pinned tables!");
+    if (!table_is_empty(table)) {
+      const auto *entries = (page_table *)table_address(table);
+      for (unsigned i = 0; i < NUM_PAGE_TABLE_ENTRIES; ++i)
+        if ((*entries)[i] & attributes::PRESENT)
+          kstd::panic("Tried to map huge page over present page!\n"
+                      "Virtual :%p\n",
+                      (void *)((uintptr_t)virtual_page + i * PAGE_SIZE));
+    }
+    it.set(0);
+    invlpg((uintptr_t)virtual_page);
+    kernel_table_freed((uintptr_t)virtual_page);
+    release_page_level(table);
+  }
+
+  it.set(physical_page | with_global((uintptr_t)virtual_page, attrs) |
+         attributes::HUGE | attributes::PRESENT);
+  invlpg((uintptr_t)virtual_page);
+  return virtual_page;
+}
+
+void page_tables::unmap_huge_page(void *virtual_page) {
+  assert((uintptr_t)virtual_page % HUGE_PAGE_SIZE == 0 &&
+         "virtual address should be 2MiB-aligned!");
+  auto entry = find(virtual_page);
+  if (entry == page_tables::iterator::end() || !entry.huge() ||
+      !entry.present())
+    kstd::panic("Tried to unmap non-present huge page\n"
+                "Virtual:%p",
+                virtual_page);
+
+  // Clear the whole entry rather than just the present bit, so the frame
+  // address left behind can't be mistaken for a PML1 table later.
+  tlb_batch tlb;
+  entry.set(0);
+  tlb.invalidate((uintptr_t)virtual_page);
+  release_empty_tables(entry, tlb);
+}
+
+void page_tables::split_huge_page(iterator it) {
+  assert(it.huge() && "can only split huge pages!");
+  assert(allocate &&
+         "tried to allocate before table allocator was initialized!");
+  const uintptr_t entry = *it;
+  const auto physical_page = it.physical_page_address();
+  const auto page_size = it.page_size() / NUM_PAGE_TABLE_ENTRIES;
+  // Keep everything but the address, PAT bit included. Below level 2, the
+  // HUGE bit has to go, since the PAT bit goes there in a PML1 entry.
+  auto flags = (entry & ~ADDRESS_MASK) | (entry & attributes::PAT);
+  if (it.level() == 2)
+    flags = to_pml1_attributes(flags & ~attributes::HUGE);
+
+  const auto table = allocate();
+  auto *entries = (page_table *)table_address(table);
+  for (unsigned i = 0; i < NUM_PAGE_TABLE_ENTRIES; ++i)
+    (*entries)[i] = (physical_page + i * page_size) | flags;
+  count_live_entries(table, NUM_PAGE_TABLE_ENTRIES);
+  *it = table | attributes::RW | attributes::PRESENT;
+  invlpg(it.virtual_page_address());
+}
+
+// Calls `f(it, v)` for each entry mapping a page in [start, end), where `v` is
+// the address it maps, walking the tables once instead of from the top for
+// every page. Huge pages that stick out of the range are split first.
+//
+// `leave(it)` is called with `it` at the entry pointing to each table the walk
+// is done with, and returns whether it got rid of the table.
+template <typename F, typename L>
+static void for_each_page_in_range(page_tables &tables, uintptr_t start,
+                                   uintptr_t end, F &&f, L &&leave) {
+  assert(start % memory::PAGE_SIZE == 0 &&
          "virtual start address should be page-aligned!");
-  assert((uintptr_t)virtual_end % memory::PAGE_SIZE == 0 &&
+  assert(end % memory::PAGE_SIZE == 0 &&
          "virtual end address should be page-aligned!");
-  for (char *p = (char *)virtual_start; p != virtual_end;
-       p += memory::PAGE_SIZE)
-    unmap_page(p);
+  if (start == end)
+    return;
+  auto it = page_tables::iterator(tables.base, (void *)start);
+  for (auto v = start;;) {
+    while (it.descend())
+      ;
+    if ((it.level() != 1 && !it.huge()) || !it.present())
+      kstd::panic("Tried to change non-present page\n"
+                  "Virtual:%p",
+                  (void *)v);
+    assert(it.virtual_page_address() == v &&
+           "iterator and virtual address out of sync!");
+    const auto page_size = it.page_size();
+    if (it.huge() && (v % page_size != 0 || end - v < page_size)) {
+      tables.split_huge_page(it);
+      continue;
+    }
+    f(it, v);
+    v += page_size;
+    if (v >= end) {
+      // A table that's kept means the ones above it are kept too.
+      while (it.level() < 4) {
+        it.ascend();
+        if (!leave(it))
+          break;
+      }
+      return;
+    }
+    while (++it == page_tables::iterator::end(it.level())) {
+      it.ascend();
+      leave(it);
+    }
+  }
+}
+
+void page_tables::unmap_range(void *virtual_start, void *virtual_end,
+                              tlb_batch &tlb, bool free_pages) {
+  for_each_page_in_range(
+      *this, (uintptr_t)virtual_start, (uintptr_t)virtual_end,
+      [&](iterator &it, uintptr_t v) {
+        const auto physical_page = it.physical_page_address();
+        const auto pages = it.page_size() / PAGE_SIZE;
+        if (it.huge())
+          it.set(0);
+        else
+          it.set(*it & ~attributes::PRESENT);
+        // Queue the invalidation first, so any flush the batch does while
+        // queueing the free covers this page too.
+        tlb.invalidate(v);
+        if (free_pages)
+          tlb.free_after_flush(physical_page, pages);
+      },
+      [&](iterator &it) {
+        // The invalidations queued for the pages it mapped cover the table
+        // too, since invalidating also drops cached paging structures.
+        const auto table = *it & ADDRESS_MASK;
+        if (it.level() > 3 || !table_is_empty(table))
+          return false;
+        it.set(0);
+        kernel_table_freed(it.virtual_page_address());
+        tlb.free_after_flush(table, 1);
+        return true;
+      });
+}
+
+void page_tables::protect_range(void *virtual_start, void *virtual_end,
+                                attributes attrs) {
+  const uintptr_t MASK = attributes::RW | attributes::USER | attributes::XD;
+  tlb_batch tlb;
+  for_each_page_in_range(
+      *this, (uintptr_t)virtual_start, (uintptr_t)virtual_end,
+      [&](iterator &it, uintptr_t v) {
+        *it = (*it & ~MASK) | ((uintptr_t)attrs & MASK);
+        tlb.invalidate(v);
+      },
+      [](iterator &) { return false; });
 }
 
 void *
@@ -393,45 +909,343 @@ void *page_tables::identity_map_page_range_into_kernel_space(uintptr_t address,
                         attrs);
 }
 
+void *map_mmio(uintptr_t physical_address, size_t size, attributes attrs) {
+  const auto offset = physical_address % PAGE_SIZE;
+  const auto first_page = physical_address - offset;
+  const auto mapped_size = kstd::align_to(offset + size, PAGE_ALIGN);
+  auto *window = (char *)vma::get_mmio_pages(mapped_size);
+  kernel_page_tables.map_range_size(first_page, window, mapped_size, attrs);
+  return window + offset;
+}
+
+constexpr static size_t MAX_USER_ADDRESS_SPACES = 256;
+static page_tables user_address_spaces[MAX_USER_ADDRESS_SPACES];
+static uint64_t user_address_spaces_used[MAX_USER_ADDRESS_SPACES / 64];
+
+bool pcid_supported() { return pcid_enabled; }
+
+page_tables &current_page_tables() { return *current_tables; }
+
+void switch_to(page_tables &tables) {
+  if (&tables == current_tables)
+    return;
+  auto cr3 = table_physical_address(tables.base);
+  if (pcid_enabled) {
+    cr3 |= tables.pcid;
+    // Bit 63 keeps the PCID's TLB entries, rather than flushing them.
+    if (use_pcid && tables.tlb_generation == kernel_tlb_generation)
+      cr3 |= 1ULL << 63;
+  }
+  asm volatile("mov %0, %%cr3" ::"r"(cr3) : "memory");
+  tables.tlb_generation = kernel_tlb_generation;
+  current_tables = &tables;
+}
+
+// Size of the memory mapped by a leaf entry at `level`.
+static size_t page_size_at(unsigned level) {
+  return (size_t)1 << (LOG2_PAGE_ALIGN + LOG2_PAGE_TABLE_SIZE * (level - 1));
+}
+
+static bool is_leaf(uintptr_t entry, unsigned level) {
+  return level == 1 || (entry & attributes::HUGE);
+}
+
+// Releases `table`, which is at `level`, along with every table under it,
+// dropping a reference to each page they map.
+static void release_table_tree(uintptr_t table, unsigned level) {
+  const auto *entries = (page_table *)table_address(table);
+  for (unsigned i = 0; i < NUM_PAGE_TABLE_ENTRIES; ++i) {
+    const uintptr_t entry = (*entries)[i];
+    if (!(entry & attributes::PRESENT))
+      continue;
+    if (!is_leaf(entry, level)) {
+      release_table_tree(entry & ADDRESS_MASK, level - 1);
+      continue;
+    }
+    const auto page = entry & ADDRESS_MASK & -page_size_at(level);
+    for (size_t offset = 0; offset < page_size_at(level); offset += PAGE_SIZE)
+      pma::put_page(page + offset);
+  }
+  release_page_level(table);
+}
+
+// Copies `table`, which is at `level`, and every table under it, sharing the
+// pages they map copy-on-write. Returns the copy.
+static uintptr_t clone_table_tree(uintptr_t table, unsigned level) {
+  auto *entries = (page_table *)table_address(table);
+  const auto copy = allocate_page_level();
+  auto *copied_entries = (page_table *)table_address(copy);
+  unsigned live_entries = 0;
+  for (unsigned i = 0; i < NUM_PAGE_TABLE_ENTRIES; ++i) {
+    uintptr_t entry = (*entries)[i];
+    if (!(entry & attributes::PRESENT))
+      continue;
+    live_entries += 1;
+    if (!is_leaf(entry, level)) {
+      (*copied_entries)[i] =
+          clone_table_tree(entry & ADDRESS_MASK, level - 1) |
+          (entry & ~ADDRESS_MASK);
+      continue;
+    }
+    if (entry & attributes::RW) {
+      entry = (entry & ~attributes::RW) | attributes::COPY_ON_WRITE;
+      (*entries)[i] = entry;
+    }
+    // Huge pages are split when they're first written to, so every page in
+    // them needs a reference of its own.
+    const auto page = entry & ADDRESS_MASK & -page_size_at(level);
+    for (size_t offset = 0; offset < page_size_at(level); offset += PAGE_SIZE)
+      pma::get_page(page + offset);
+    (*copied_entries)[i] = entry;
+  }
+  count_live_entries(copy, live_entries);
+  return copy;
+}
+
 page_tables *allocate_user_space_page_tables() {
- return nullptr;
+  for (size_t i = 0; i < MAX_USER_ADDRESS_SPACES / 64; ++i) {
+    if (user_address_spaces_used[i] == ~0ULL)
+      continue;
+    const auto bit = __builtin_ctzll(~user_address_spaces_used[i]);
+    user_address_spaces_used[i] |= 1ULL << bit;
+    const auto slot = i * 64 + bit;
+
+    auto &tables = user_address_spaces[slot];
+    const auto pml4 = allocate_page_level();
+    tables.base = (page_table *)table_address(pml4);
+    tables.allocate = &allocate_page_level;
+    tables.pcid = slot + 1;
+    // The PCID may have been used by an address space that's since been
+    // freed, so the first switch to it has to flush.
+    tables.tlb_generation = (uint64_t)-1;
+    unsigned shared = 0;
+    for (unsigned j = NUM_PAGE_TABLE_ENTRIES / 2; j < NUM_PAGE_TABLE_ENTRIES;
+         ++j) {
+      (*tables.base)[j] = kernel_pml4[j];
+      if (kernel_pml4[j] & attributes::PRESENT)
+        shared += 1;
+    }
+    count_live_entries(pml4, shared);
+    return &tables;
+  }
+  kstd::panic("paging: out of user address spaces!");
 }
 
-void page_tables::dump_to_file(FILE *out) const {
-  for (uint64_t i = 0; i < NUM_PAGE_TABLE_ENTRIES; ++i) {
-    const uintptr_t pml4_entry = (*base)[i];
-    if ((pml4_entry & attributes::PRESENT) == 0)
+page_tables *clone_user_space_page_tables(page_tables &parent) {
+  auto *tables = allocate_user_space_page_tables();
+  unsigned live_entries = 0;
+  for (unsigned i = 0; i < NUM_PAGE_TABLE_ENTRIES / 2; ++i) {
+    const uintptr_t entry = (*parent.base)[i];
+    if (!(entry & attributes::PRESENT))
       continue;
+    (*tables->base)[i] =
+        clone_table_tree(entry & ADDRESS_MASK, 3) | (entry & ~ADDRESS_MASK);
+    live_entries += 1;
+  }
+  count_live_entries(table_physical_address(tables->base), live_entries);
+
+  // The parent may still have the pages cached as writable.
+  if (&parent == current_tables)
+    flush_tlb();
+  else
+    parent.tlb_generation = (uint64_t)-1;
+  return tables;
+}
 
-    const page_table *pml3 = (page_table *)(pml4_entry & ~PREFIX_MASK);
-    for (uint64_t j = 0; j < NUM_PAGE_TABLE_ENTRIES; ++j) {
-      const uintptr_t pml3_entry = (*pml3)[j];
-      if ((pml3_entry & attributes::PRESENT) == 0)
+bool is_copy_on_write(const void *address) {
+  const auto entry =
+      current_tables->find((void *)((uintptr_t)address & -PAGE_SIZE));
+  return entry != page_tables::iterator::end() && entry.present() &&
+         (*entry & attributes::COPY_ON_WRITE);
+}
+
+bool handle_copy_on_write_fault(void *address) {
+  const auto virtual_page = (void *)((uintptr_t)address & -PAGE_SIZE);
+  if (!is_copy_on_write(virtual_page))
+    return false;
+  auto entry = current_tables->find(virtual_page);
+  if (entry.huge()) {
+    current_tables->split_huge_page(entry);
+    entry = current_tables->find(virtual_page);
+  }
+
+  const auto page = entry.physical_page_address();
+  const auto flags =
+      (*entry & ~ADDRESS_MASK & ~attributes::COPY_ON_WRITE) | attributes::RW;
+  if (pma::page_of(page).refcount == 1) {
+    // Everything else that shared it has made a copy of its own already.
+    *entry = page | flags;
+  } else {
+    const auto copy = pma::get_physical_page();
+    memcpy(memory::phys_to_virt(copy), memory::phys_to_virt(page), PAGE_SIZE);
+    *entry = copy | flags;
+    pma::put_page(page);
+  }
+  invlpg((uintptr_t)virtual_page);
+  return true;
+}
+
+void free_user_space_page_tables(page_tables *tables) {
+  assert(tables != current_tables && "freeing the current address space!");
+  const auto slot = tables - user_address_spaces;
+  assert(slot >= 0 && (size_t)slot < MAX_USER_ADDRESS_SPACES &&
+         (user_address_spaces_used[slot / 64] & (1ULL << (slot % 64))) &&
+         "not a user address space!");
+  for (unsigned i = 0; i < NUM_PAGE_TABLE_ENTRIES / 2; ++i) {
+    const uintptr_t entry = (*tables->base)[i];
+    if (entry & attributes::PRESENT)
+      release_table_tree(entry & ADDRESS_MASK, 3);
+  }
+  release_page_level(table_physical_address(tables->base));
+  *tables = page_tables{};
+  user_address_spaces_used[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+namespace {
+// Parts of the address space, for the totals at the end of a dump.
+enum class region { user, physmap, heap, stacks, mmio, kernel, other, count };
+} // namespace
+
+static const char *const region_names[] = {
+    "user", "physmap", "heap", "stacks", "mmio", "kernel", "other",
+};
+static_assert(sizeof(region_names) / sizeof(region_names[0]) ==
+                  (size_t)region::count,
+              "missing region names!");
+
+static region region_of(uintptr_t virtual_address) {
+  if (!is_kernel_address(virtual_address))
+    return region::user;
+  if (virtual_address >= memory::PHYSMAP_START &&
+      virtual_address < memory::PHYSMAP_END)
+    return region::physmap;
+  if (virtual_address >= memory::HEAP_START &&
+      virtual_address < memory::HEAP_END)
+    return region::heap;
+  if (virtual_address >= memory::STACKS_START &&
+      virtual_address < memory::STACKS_END)
+    return region::stacks;
+  if (virtual_address >= memory::MMIO_START &&
+      virtual_address < memory::MMIO_END)
+    return region::mmio;
+  if (virtual_address >= memory::KERNEL_VMA_START &&
+      virtual_address < memory::KERNEL_VMA_END)
+    return region::kernel;
+  return region::other;
+}
+
+// Walks the page tables for `page_tables::dump_to_file`. Runs of mappings that
+// are contiguous both virtually and physically, with the same attributes, are
+// printed as a single range.
+struct page_table_dump {
+  // The attributes that have to match for mappings to be merged.
+  constexpr static uint64_t FLAGS =
+      (uint64_t)attributes::RW | (uint64_t)attributes::USER |
+      (uint64_t)attributes::WRITE_THROUGH |
+      (uint64_t)attributes::CACHE_DISABLE | (uint64_t)attributes::GLOBAL |
+      (uint64_t)attributes::COPY_ON_WRITE | (uint64_t)attributes::XD |
+      (uint64_t)attributes::PAT;
+
+  FILE *out;
+  uintptr_t run_virtual = 0;
+  uintptr_t run_physical = 0;
+  uintptr_t run_flags = 0;
+  size_t run_size = 0;
+
+  size_t ranges = 0;
+  // By level: 4KiB, 2MiB and 1GiB pages.
+  size_t leaves[3] = {0, 0, 0};
+  size_t tables = 0;
+  size_t region_bytes[(size_t)region::count] = {};
+
+  void walk(const page_table *table, unsigned level, uintptr_t virtual_base) {
+    tables += 1;
+    for (unsigned i = 0; i < NUM_PAGE_TABLE_ENTRIES; ++i) {
+      const uintptr_t entry = (*table)[i];
+      if (!(entry & attributes::PRESENT))
         continue;
+      const uintptr_t virtual_address = kstd::sign_extend(
+          virtual_base + i * page_size_at(level), VIRTUAL_ADDRESS_BITS);
+      if (level < 4 && is_leaf(entry, level))
+        leaf(virtual_address, entry, level);
+      else
+        walk((page_table *)table_address(entry & ADDRESS_MASK), level - 1,
+             virtual_address);
+    }
+  }
 
-      const page_table *pml2 = (page_table *)(pml3_entry & ~PREFIX_MASK);
-      for (uint64_t k = 0; k < NUM_PAGE_TABLE_ENTRIES; ++k) {
-        const uintptr_t pml2_entry = (*pml2)[k];
-        if ((pml2_entry & attributes::PRESENT) == 0)
-          continue;
-
-        const page_table *pml1 = (page_table *)(pml2_entry & ~PREFIX_MASK);
-        for (uint64_t l = 0; l < NUM_PAGE_TABLE_ENTRIES; ++l) {
-          const uintptr_t pml1_entry = (*pml1)[l];
-          if ((pml1_entry & attributes::PRESENT) == 0)
-            continue;
-          const uintptr_t virtual_addr =
-              kstd::sign_extend((l << 12) | (k << 21) | (j << 30) | (i << 39),
-                                /*num_source_bits=*/42);
-          const uintptr_t physical_addr = pml1_entry & ADDRESS_MASK;
-          const char *rw_flags = (pml1_entry & attributes::RW) ? "rw" : "r";
-          const char *x_flags = (pml1_entry & attributes::XD) ? "" : "x";
-          fprintf(out, "Virtual 0x%p -> Physical 0x%p (%s%s)\n",
-                  (void *)virtual_addr, (void *)physical_addr, rw_flags,
-                  x_flags);
-        }
-      }
+  void leaf(uintptr_t virtual_address, uintptr_t entry, unsigned level) {
+    const auto size = page_size_at(level);
+    const auto physical_address = entry & ADDRESS_MASK & -size;
+    const auto flags =
+        (level == 1 ? from_pml1_attributes(entry & ~attributes::PAT) : entry) &
+        FLAGS;
+    leaves[level - 1] += 1;
+    region_bytes[(size_t)region_of(virtual_address)] += size;
+
+    if (run_size != 0 && run_virtual + run_size == virtual_address &&
+        run_physical + run_size == physical_address && run_flags == flags) {
+      run_size += size;
+      return;
     }
+    end_run();
+    run_virtual = virtual_address;
+    run_physical = physical_address;
+    run_flags = flags;
+    run_size = size;
   }
+
+  void end_run() {
+    if (run_size == 0)
+      return;
+    char flags[32] = "r";
+    if (run_flags & attributes::RW)
+      strcat(flags, "w");
+    if (!(run_flags & attributes::XD))
+      strcat(flags, "x");
+    if (run_flags & attributes::USER)
+      strcat(flags, " user");
+    if (run_flags & attributes::GLOBAL)
+      strcat(flags, " global");
+    switch (pat_entries[pat_index(run_flags)]) {
+    case MEMORY_TYPE_UC:
+      strcat(flags, " uncached");
+      break;
+    case MEMORY_TYPE_UC_MINUS:
+      strcat(flags, " uncached-");
+      break;
+    case MEMORY_TYPE_WC:
+      strcat(flags, " write-combining");
+      break;
+    case MEMORY_TYPE_WT:
+      strcat(flags, " write-through");
+      break;
+    case MEMORY_TYPE_WB:
+      break;
+    }
+    if (run_flags & attributes::COPY_ON_WRITE)
+      strcat(flags, " cow");
+    fprintf(out, "Virtual 0x%p - 0x%p -> Physical 0x%p (%s, %zu KiB)\n",
+            (void *)run_virtual, (void *)(run_virtual + run_size - 1),
+            (void *)run_physical, flags, run_size / 1024);
+    ranges += 1;
+    run_size = 0;
+  }
+};
+
+void page_tables::dump_to_file(FILE *out) const {
+  page_table_dump dump{out};
+  dump.walk(base, 4, 0);
+  dump.end_run();
+
+  fprintf(out,
+          "%zu range(s) of %zu 4KiB, %zu 2MiB and %zu 1GiB page(s), using %zu "
+          "page table(s) (%zu KiB)\n",
+          dump.ranges, dump.leaves[0], dump.leaves[1], dump.leaves[2],
+          dump.tables, dump.tables * PAGE_SIZE / 1024);
+  for (size_t r = 0; r < (size_t)region::count; ++r)
+    if (dump.region_bytes[r] != 0)
+      fprintf(out, "  %s: %zu KiB mapped\n", region_names[r],
+              dump.region_bytes[r] / 1024);
 }
 } // namespace paging
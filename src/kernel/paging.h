@@ -11,6 +11,10 @@
 namespace paging {
 
 void early_init();
+// Maps all of physical RAM into the physmap, with the biggest pages that fit.
+// Has to run before `enable_kernel_page_protection` switches to the kernel's
+// page tables, while the tables for it can still come from low memory.
+void map_physical_memory();
 void enable_kernel_page_protection(uintptr_t kernel_stack_base);
 void finish_init();
 
@@ -21,6 +25,8 @@ constexpr unsigned int LOG2_PAGE_TABLE_SIZE = 9;
 constexpr unsigned int LOG2_PAGE_ALIGN = 12;
 constexpr uintptr_t PREFIX_MASK = (1 << LOG2_PAGE_TABLE_SIZE) - 1;
 constexpr uintptr_t ADDRESS_MASK = 0x000FFFFFFFFFF000;
+// 4-level paging translates 48-bit virtual addresses, sign extended to 64.
+constexpr unsigned VIRTUAL_ADDRESS_BITS = 48;
 
 struct attributes {
   enum vals : uint64_t {
@@ -32,6 +38,28 @@ struct attributes {
     RW = 1ULL << 1,
     // If set, the page is accessible from user-code.
     USER = 1ULL << 2,
+    // If set, writes to the page go straight through to memory.
+    WRITE_THROUGH = 1ULL << 3,
+    // If set, accesses to the page aren't cached, as device memory needs.
+    CACHE_DISABLE = 1ULL << 4,
+    // If set in a PML2 entry, it maps a 2MiB page directly instead of pointing
+    // to a PML1 table.
+    HUGE = 1ULL << 7,
+    // If set, the page's TLB entry survives CR3 being reloaded, and is shared
+    // by every PCID. Only for mappings that are the same in every address
+    // space.
+    GLOBAL = 1ULL << 8,
+    // Ignored by the CPU. Marks a page that's shared read-only between
+    // address spaces, and copied on the first write to it.
+    COPY_ON_WRITE = 1ULL << 9,
+    // Picks the PAT entry that gives the page's memory type, along with
+    // WRITE_THROUGH and CACHE_DISABLE. This is where 2MiB and 1GiB pages have
+    // it; 4KiB pages have it in bit 7 instead, which `map_page` takes care of.
+    PAT = 1ULL << 12,
+    // Memory types, as `enable_kernel_page_protection` sets up the PAT. Pages
+    // are write-back unless given one of these.
+    WRITE_COMBINING = PAT,
+    UNCACHED = WRITE_THROUGH | CACHE_DISABLE,
     // If set, the page is not executable.
     XD = 1ULL << 63,
   } v;
@@ -49,10 +77,37 @@ inline attributes::vals operator|(attributes::vals a, attributes::vals b) {
 }
 inline uint64_t operator~(attributes a) { return ~(uint64_t)a; }
 
+// Set once the kernel's page tables, and with them the physmap, are live.
+extern bool physmap_ready;
+
+// Where the page table at `physical_address` can be reached. Before the
+// physmap is live, only tables in the first 2MiB can be, since that's what
+// the boot page tables map along with the kernel.
+inline uintptr_t table_address(uintptr_t physical_address) {
+  return physical_address + (physmap_ready
+                                 ? memory::PHYSMAP_START
+                                 : (uintptr_t)memory::KERNEL_VMA_OFFSET);
+}
+
 static constexpr auto NUM_PAGE_TABLE_ENTRIES = 512;
 using page_table = volatile uintptr_t[NUM_PAGE_TABLE_ENTRIES];
 using page_table_allocator = uintptr_t();
 
+// The physical address of the page table `entry` is in. Tables are either
+// reached through the physmap, or are part of the kernel image.
+inline uintptr_t table_physical_address(const volatile void *entry) {
+  const auto address = (uintptr_t)entry & -memory::PAGE_SIZE;
+  if (address >= memory::PHYSMAP_START && address < memory::PHYSMAP_END)
+    return address - memory::PHYSMAP_START;
+  return address - memory::KERNEL_VMA_OFFSET;
+}
+// Adds `delta` to the number of present entries in `table`. Only tables
+// allocated from the pma keep a count, since they're the only ones that get
+// freed: the ones set up before it are left alone.
+void count_live_entries(uintptr_t table, int delta);
+// Whether `table` is one that's counted, and has no present entries left.
+bool table_is_empty(uintptr_t table);
+
 class page_entry_lookup_info {
   size_t indices[4] = {0};
 
@@ -100,6 +155,45 @@ public:
   }
 };
 
+// Above this many pages, flushing a `tlb_batch` flushes the whole TLB instead
+// of invalidating each page with `invlpg`. That's a CR3 reload if they're all
+// user pages, or toggling CR4.PGE if global kernel pages are among them.
+extern size_t tlb_full_flush_threshold;
+
+// Collects the TLB invalidations needed by an operation on a range of the page
+// tables, to do them all at once at the end, along with the physical pages
+// that can only be freed once no stale translation can reach them anymore.
+// Flushes when destroyed.
+class tlb_batch {
+public:
+  tlb_batch() = default;
+  tlb_batch(const tlb_batch &) = delete;
+  tlb_batch &operator=(const tlb_batch &) = delete;
+  ~tlb_batch() { flush(); }
+
+  void invalidate(uintptr_t virtual_page);
+  // Frees the `n` physical pages at `physical_page` after the next flush.
+  void free_after_flush(uintptr_t physical_page, size_t n);
+  void flush();
+
+private:
+  constexpr static size_t MAX_PAGES = 64;
+  constexpr static size_t MAX_FREES = 64;
+  struct pending_free {
+    uintptr_t physical_page;
+    size_t n;
+  };
+
+  uintptr_t pages[MAX_PAGES];
+  // May be more than MAX_PAGES (when that's past the threshold anyway), in
+  // which case only a full flush will do.
+  size_t num_pages = 0;
+  // Whether any of the pages are in the kernel's half, and so global.
+  bool has_global_pages = false;
+  pending_free frees[MAX_FREES];
+  size_t num_frees = 0;
+};
+
 class page_tables {
   template <typename table_ty>
   class _iterator {
@@ -157,28 +251,52 @@ class page_tables {
       return (*table)[idx];
     }
 
+    // Writes `value` to the entry, keeping count of the table's present
+    // entries.
+    void set(uintptr_t value) {
+      const bool was_present = present();
+      **this = value;
+      const bool is_present = (value & attributes::PRESENT) != 0;
+      if (was_present != is_present)
+        count_live_entries(table(), is_present ? 1 : -1);
+    }
+
+    // Physical address of the table the entry is in.
+    uintptr_t table() const { return table_physical_address(tables[_level]); }
+
     bool exists() const { return tables[_level] != nullptr; }
     bool present() const { return **this & attributes::PRESENT; }
+    // Whether this entry maps a 2MiB (level 2) or 1GiB (level 3) page
+    // directly, instead of pointing to a table.
+    bool huge() const {
+      return (level() == 2 || level() == 3) &&
+             (**this & attributes::HUGE) != 0;
+    }
+    // Size of the memory mapped by an entry at this level.
+    size_t page_size() const {
+      return (size_t)1 << (LOG2_PAGE_ALIGN + LOG2_PAGE_TABLE_SIZE * _level);
+    }
 
     uintptr_t physical_page_address() const {
-      assert(level() == 1 && "can't get physical addr of non level 1 page!");
-      return **this & ADDRESS_MASK;
+      assert((level() == 1 || huge()) &&
+             "can't get physical addr of non level 1 page!");
+      return **this & ADDRESS_MASK & -page_size();
     }
 
     uintptr_t virtual_page_address() const {
       return kstd::sign_extend(
           ((uintptr_t)indices[3] << 39) | ((uintptr_t)indices[2] << 30) |
               ((uintptr_t)indices[1] << 21) | ((uintptr_t)indices[0] << 12),
-          /*num_source_bits=*/42);
+          VIRTUAL_ADDRESS_BITS);
     }
 
     bool descend() {
       if (level() == 1 || indices[_level] >= NUM_PAGE_TABLE_ENTRIES ||
-          !exists() || !present())
+          !exists() || !present() || huge())
         return false;
 
-      tables[--_level] = reinterpret_cast<table_ty *>(
-          (**this & ~PREFIX_MASK) + memory::KERNEL_VMA_OFFSET);
+      tables[--_level] =
+          reinterpret_cast<table_ty *>(table_address(**this & ADDRESS_MASK));
       return true;
     }
 
@@ -190,17 +308,18 @@ class page_tables {
 
       auto addr = (uintptr_t)nullptr;
 
-      if (tables[_level] != nullptr)
-        addr = **this & ~PREFIX_MASK;
+      if (tables[_level] != nullptr) {
+        assert(!huge() && "can't descend into a huge page!");
+        addr = **this & ADDRESS_MASK;
+      }
 
       if (addr == (uintptr_t) nullptr) {
         addr = allocate();
-        **this = addr | attributes::RW | attributes::PRESENT;
+        set(addr | attributes::RW | attributes::PRESENT);
       }
 
       assert(addr % memory::PAGE_ALIGN == 0 && "address isn't page-aligned?");
-      tables[--_level] =
-          reinterpret_cast<table_ty *>(addr + memory::KERNEL_VMA_OFFSET);
+      tables[--_level] = reinterpret_cast<table_ty *>(table_address(addr));
     }
 
     void ascend() {
@@ -232,6 +351,12 @@ class page_tables {
 public:
   page_table *base = nullptr;
   page_table_allocator *allocate = nullptr;
+  // Tags the TLB entries made while this is the current address space, when
+  // PCIDs are enabled. The kernel's is 0.
+  uint16_t pcid = 0;
+  // Generation of the kernel's mappings this address space's TLB entries are
+  // known to be up to date with. See `switch_to`.
+  uint64_t tlb_generation = 0;
 
   using iterator = _iterator<page_table>;
   using const_iterator = _iterator<const page_table>;
@@ -239,11 +364,14 @@ public:
   iterator begin() { return iterator{base}; }
   const_iterator begin() const { return const_iterator{base}; }
 
+  // Finds the entry mapping `page`. That's a level 1 entry, unless `page` is
+  // part of a huge page, in which case it's the level 2 or 3 entry mapping
+  // it.
   iterator find(const void *page) {
     auto cursor = iterator(base, page);
     while (cursor.descend())
       ;
-    if (cursor.level() != 1)
+    if (cursor.level() != 1 && !cursor.huge())
       return page_tables::iterator::end();
     return cursor;
   }
@@ -265,6 +393,9 @@ public:
     return const_cast<page_tables *>(this)->get(page);
   }
 
+  // Maps a range with the biggest pages that fit: 1GiB and 2MiB pages
+  // wherever both addresses are aligned for them, and 4KiB pages for the
+  // rest.
   void *map_range(uintptr_t physical_start, uintptr_t physical_end,
                   void *virtual_start, void *virtual_end,
                   attributes attrs = attributes::RW | attributes::XD);
@@ -275,7 +406,40 @@ public:
   void *map_page(uintptr_t physical_page, void *virtual_page,
                  attributes attrs = attributes::RW | attributes::XD);
   void unmap_page(void *virtual_page);
-  void unmap_range(void *virtual_start, void *virtual_end);
+  // Allocates the PML1 tables covering a range, and keeps them from being
+  // freed while they're empty until `unpin_tables`. Mapping and unmapping
+  // 4KiB pages in the range then never allocates or frees a table.
+  void pin_tables(void *virtual_start, void *virtual_end);
+  void unpin_tables(void *virtual_start, void *virtual_end);
+  // Maps `physical_page` at `virtual_page`, in place of whatever was mapped
+  // there, in tables pinned by `pin_tables`. Doesn't touch the table's count
+  // of live entries, so it's safe while someone else may be updating it:
+  // `count_pinned_page` has to be called once that's safe, if nothing was
+  // mapped there before.
+  void map_pinned_page(uintptr_t physical_page, void *virtual_page,
+                       attributes attrs);
+  void count_pinned_page(void *virtual_page);
+  // Maps a 2MiB page with a single PML2 entry. Both addresses must be 2MiB
+  // aligned, and nothing in the virtual range may be mapped yet.
+  void *map_huge_page(uintptr_t physical_page, void *virtual_page,
+                      attributes attrs = attributes::RW | attributes::XD);
+  void unmap_huge_page(void *virtual_page);
+  // Unmaps a range, whatever size of pages it was mapped with, in one pass
+  // over the tables. Huge pages that are only partly in the range are split
+  // first. The invalidations are left to `tlb`, along with freeing the
+  // physical pages if `free_pages` is set.
+  void unmap_range(void *virtual_start, void *virtual_end, tlb_batch &tlb,
+                   bool free_pages = false);
+  void unmap_range(void *virtual_start, void *virtual_end) {
+    tlb_batch tlb;
+    unmap_range(virtual_start, virtual_end, tlb);
+  }
+  // Changes the RW, USER and XD attributes of a mapped range to `attrs`,
+  // splitting any huge pages that are only partly in the range.
+  void protect_range(void *virtual_start, void *virtual_end, attributes attrs);
+  // Replaces the huge page at `it` with a table mapping the same memory with
+  // pages of the next size down, with the same attributes.
+  void split_huge_page(iterator it);
   void *identity_map_pages_into_kernel_space(uintptr_t address, size_t n,
                                              attributes attrs = attributes::RW |
                                                                 attributes::XD);
@@ -321,7 +485,46 @@ public:
 };
 
 extern page_tables kernel_page_tables;
+// Maps `size` bytes of device memory at `physical_address` into the MMIO
+// window, uncached, and returns where `physical_address` ended up.
+void *map_mmio(uintptr_t physical_address, size_t size,
+               attributes attrs = attributes::RW | attributes::XD |
+                                  attributes::CACHE_DISABLE);
+
+// Whether switching address spaces keeps the TLB entries of each one around,
+// tagged with its PCID, rather than flushing them. Has no effect when the CPU
+// doesn't support PCIDs, in which case every switch flushes.
+extern bool use_pcid;
+bool pcid_supported();
+// Makes `tables` the current address space, by loading it into CR3.
+//
+// Kernel mappings are global, so invalidating one reaches every PCID. Cached
+// paging structures aren't though, so freeing a kernel table bumps a
+// generation count instead, and switching to an address space that's behind
+// on it flushes its TLB entries. Changes to the user half of an address space
+// have to be made while it's current.
+void switch_to(page_tables &tables);
+page_tables &current_page_tables();
+// A new address space for a user task, with a PCID of its own. The kernel's
+// half is shared with `kernel_page_tables`, and the user half starts out
+// empty.
 page_tables *allocate_user_space_page_tables();
+// A new address space whose user half has the same contents as `parent`'s.
+// Instead of copying them, every page is shared copy-on-write: read-only in
+// both, and copied by whichever writes to it first. Only the tables are
+// copied. Pages in the user half have to come from the pma.
+page_tables *clone_user_space_page_tables(page_tables &parent);
+// Whether `address` is in a copy-on-write page of the current address space.
+bool is_copy_on_write(const void *address);
+// Handles a write to a copy-on-write page of the current address space, by
+// giving it a copy of the page of its own, or the page itself if nothing else
+// shares it anymore. Returns whether `address` was in such a page. Must hold
+// `alloc::malloc_lock`.
+bool handle_copy_on_write_fault(void *address);
+// Frees an address space from `allocate_user_space_page_tables`, along with
+// the tables of its user half, and drops a reference to each page they map.
+// Mustn't be the current address space.
+void free_user_space_page_tables(page_tables *tables);
 
 } // namespace paging
 
@@ -6,82 +6,483 @@
 #include "util.h"
 #include "vma.h"
 
-#include "libadt/intrusive_bitmap.h"
-
+#include <algorithm>
 #include <assert.h>
+#include <bit>
 
 namespace pma {
 
-static uint64_t max_pages_total = 0;
-static uintptr_t physical_page_base = 0;
-static adt::bitmap *physical_page_map = nullptr;
-static constexpr bool FREE = false;
-static constexpr bool OCCUPIED = true;
+// Physical pages are handed out by a binary buddy allocator: free memory is
+// kept as naturally aligned blocks of 2^order pages, one free list per order.
+// Allocating splits the smallest block that's big enough, and freeing merges a
+// block with its buddy for as long as the buddy is free too, so both are
+// O(MAX_ORDER).
+//
+// Each zone has a buddy allocator of its own, and blocks never cross from one
+// zone into another.
+constexpr static unsigned MAX_ORDER = 18;
+constexpr static unsigned NUM_ORDERS = MAX_ORDER + 1;
+constexpr static unsigned NUM_ZONES = 3;
+
+constexpr static uint32_t NIL = UINT32_MAX;
+
+struct zone_info {
+  const char *name;
+  uint64_t end_pfn;
+  uint32_t free_lists[NUM_ORDERS];
+  size_t free_blocks[NUM_ORDERS];
+  // Bit `order` is set when `free_lists[order]` is non-empty.
+  uint32_t nonempty_orders;
+  uint64_t free_pages;
+  uint64_t total_pages;
+};
+
+static zone_info zones[NUM_ZONES] = {
+    {"dma", 0x1000000 / memory::PAGE_SIZE, {}, {}, 0, 0, 0},
+    {"dma32", 0x100000000 / memory::PAGE_SIZE, {}, {}, 0, 0, 0},
+    {"normal", UINT64_MAX, {}, {}, 0, 0, 0},
+};
+
+// One past the highest page frame number of any usable memory.
+static uint64_t max_pfn = 0;
+static page *pages = nullptr;
+static size_t metadata_size = 0;
+bool physical_memory_allocator_available = false;
+
+static unsigned zone_of_pfn(uint64_t pfn) {
+  unsigned z = 0;
+  while (pfn >= zones[z].end_pfn)
+    z += 1;
+  return z;
+}
+
+static zone_info &zone_of(const page &p) { return zones[(unsigned)p.zone_id]; }
+
+static unsigned order_for(size_t n) {
+  return n <= 1 ? 0 : kstd::log2_floor(n - 1) + 1;
+}
+
+static void push_block(uint64_t pfn, unsigned order) {
+  auto &link = pages[pfn];
+  auto &zone = zone_of(link);
+  link.next = zone.free_lists[order];
+  link.prev = NIL;
+  link.order = order;
+  link.flags |= page::BUDDY;
+  if (link.next != NIL)
+    pages[link.next].prev = pfn;
+  zone.free_lists[order] = pfn;
+  zone.free_blocks[order] += 1;
+  zone.nonempty_orders |= 1u << order;
+}
+
+static void remove_block(uint64_t pfn, unsigned order) {
+  auto &link = pages[pfn];
+  auto &zone = zone_of(link);
+  assert((link.flags & page::BUDDY) && link.order == order &&
+         "block isn't on a free list!");
+  if (link.prev != NIL)
+    pages[link.prev].next = link.next;
+  else
+    zone.free_lists[order] = link.next;
+  if (link.next != NIL)
+    pages[link.next].prev = link.prev;
+  link.flags &= ~page::BUDDY;
+  zone.free_blocks[order] -= 1;
+  if (zone.free_lists[order] == NIL)
+    zone.nonempty_orders &= ~(1u << order);
+}
+
+// Gives a single block back to the free lists, merging it with its buddy for
+// as long as that's free too.
+static void free_block(uint64_t pfn, unsigned order) {
+  const auto zone = pages[pfn].zone_id;
+  while (order < MAX_ORDER) {
+    const auto buddy = pfn ^ (1ull << order);
+    if (buddy >= max_pfn || !(pages[buddy].flags & page::BUDDY) ||
+        pages[buddy].order != order || pages[buddy].zone_id != zone)
+      break;
+    remove_block(buddy, order);
+    pfn = buddy < pfn ? buddy : pfn;
+    order += 1;
+  }
+  push_block(pfn, order);
+}
+
+// Frees the pages in [pfn, pfn + n), split into the largest aligned blocks
+// that fit without crossing into another zone.
+static void free_range(uint64_t pfn, uint64_t n) {
+  const auto end = pfn + n;
+  while (pfn < end) {
+    const auto block_end = std::min(end, zones[zone_of_pfn(pfn)].end_pfn);
+    auto order = std::min<unsigned>(std::countr_zero(pfn), MAX_ORDER);
+    while (pfn + (1ull << order) > block_end)
+      order -= 1;
+    free_block(pfn, order);
+    pfn += 1ull << order;
+  }
+}
+
+// Takes a block of exactly 2^order pages off one of `zone`'s free lists,
+// splitting a bigger one if needed.
+static adt::optional<uint64_t> allocate_block(zone_info &zone,
+                                              unsigned order) {
+  if (order > MAX_ORDER)
+    return adt::none;
+  const auto candidates = zone.nonempty_orders >> order;
+  if (candidates == 0)
+    return adt::none;
+  auto block_order = order + std::countr_zero(candidates);
+  const auto pfn = zone.free_lists[block_order];
+  remove_block(pfn, block_order);
+  // Hand the upper halves back until it's the right size.
+  while (block_order > order) {
+    block_order -= 1;
+    push_block(pfn + (1ull << block_order), block_order);
+  }
+  return pfn;
+}
+
+// Free single pages are kept in small per-CPU caches in front of the buddy
+// allocator, one for each zone, which are refilled and drained `CACHE_BATCH`
+// pages at a time. Single page allocations and frees, by far the most common
+// ones, then only touch the buddy lists once per batch.
+constexpr static size_t CACHE_SIZE = 64;
+constexpr static size_t CACHE_BATCH = 32;
+
+struct page_cache {
+  uint32_t pfns[CACHE_SIZE];
+  size_t count;
+};
+
+struct alignas(64) cpu_page_caches {
+  page_cache zones[NUM_ZONES];
+  size_t hits;
+  size_t refills;
+  size_t drains;
+};
+
+// The kernel only runs on one CPU for now, so there's just the one set.
+static cpu_page_caches cpu_caches;
+
+// Moves up to `CACHE_BATCH` pages from `z`'s buddy lists into its cache.
+// Returns false if there weren't any.
+static bool refill_cache(unsigned z) {
+  auto &cache = cpu_caches.zones[z];
+  while (cache.count < CACHE_BATCH) {
+    const auto pfn = allocate_block(zones[z], 0);
+    if (!pfn)
+      break;
+    cache.pfns[cache.count++] = *pfn;
+    zones[z].free_pages -= 1;
+  }
+  cpu_caches.refills += 1;
+  return cache.count != 0;
+}
+
+// Gives the `n` most recently cached pages of zone `z` back to the buddy
+// lists.
+static void drain_cache(unsigned z, size_t n) {
+  auto &cache = cpu_caches.zones[z];
+  if (cache.count == 0)
+    return;
+  for (; n > 0 && cache.count > 0; --n) {
+    free_block(cache.pfns[--cache.count], 0);
+    zones[z].free_pages += 1;
+  }
+  cpu_caches.drains += 1;
+}
+
+// Hands out the pages in [pfn, pfn + n), each with a single reference.
+static void mark_allocated(uint64_t pfn, size_t n) {
+  for (auto i = pfn; i < pfn + n; ++i) {
+    assert(pages[i].refcount == 0 && "allocating a page that's in use!");
+    pages[i].refcount = 1;
+    pages[i].owner = page_owner::none;
+  }
+}
+
+// Takes a single page from the cache of the highest zone up to `highest` that
+// has one.
+static adt::optional<uint64_t> take_cached_page(zone highest) {
+  for (int z = (int)highest; z >= 0; --z) {
+    auto &cache = cpu_caches.zones[z];
+    if (cache.count == 0 && !refill_cache(z))
+      continue;
+    cpu_caches.hits += 1;
+    const auto pfn = cache.pfns[--cache.count];
+    mark_allocated(pfn, 1);
+    return pfn;
+  }
+  return adt::none;
+}
+
+// Allocates `n` pages, aligned to at least 2^`order` pages, from the highest
+// zone up to `highest` that can satisfy it. Lower zones are only used once the
+// higher ones run out, so they're still around for callers that need them.
+// Anything past the first `n` pages of the block is freed right away.
+static adt::optional<uintptr_t> allocate_pages(size_t n, unsigned order,
+                                               zone highest) {
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    for (int z = (int)highest; z >= 0; --z) {
+      auto &zone = zones[z];
+      const auto pfn = allocate_block(zone, order);
+      if (!pfn)
+        continue;
+      free_range(*pfn + n, (1ull << order) - n);
+      mark_allocated(*pfn, n);
+      zone.free_pages -= n;
+      return *pfn * memory::PAGE_SIZE;
+    }
+    // Cached pages might be just what's missing to merge a big enough block.
+    for (unsigned z = 0; z < NUM_ZONES; ++z)
+      drain_cache(z, CACHE_SIZE);
+  }
+  return adt::none;
+}
+
+// Starts managing the pages in [first, end), which have to be free.
+static void add_range(uint64_t first, uint64_t end) {
+  if (first >= end)
+    return;
+  for (auto pfn = first; pfn < end; ++pfn) {
+    assert((pages[pfn].flags & page::RESERVED) &&
+           "range being added is already managed by the pma!");
+    pages[pfn].flags &= ~page::RESERVED;
+  }
+  free_range(first, end - first);
+  for (auto pfn = first; pfn < end;) {
+    auto &zone = zones[zone_of_pfn(pfn)];
+    const auto zone_end = std::min(end, zone.end_pfn);
+    zone.total_pages += zone_end - pfn;
+    zone.free_pages += zone_end - pfn;
+    pfn = zone_end;
+  }
+}
+
+// Calls `f(first_pfn, num_pages)` with the whole pages of each usable memory
+// map entry.
+template <typename F> static void for_each_usable_range(F &&f) {
+  using memory::PAGE_SIZE;
+  using memory::PAGE_ALIGN;
+  const auto &memory_map = memory::get_memory_map();
+  for (size_t i = 0; i < memory::get_num_memory_map_entries(); ++i) {
+    const auto &entry = memory_map[i];
+    // Entries are sorted with the usable ones first.
+    if (entry.type != memory::memory_map_entry::usable)
+      break;
+    // Low memory still holds what the bootloader left behind, so it's only
+    // handed out by `memory::reclaim_boot_memory`.
+    if (entry.base < memory::KERNEL_LMA_START)
+      continue;
+    const auto first = kstd::align_to(entry.base, PAGE_ALIGN) / PAGE_SIZE;
+    const auto end = (entry.base + entry.length) / PAGE_SIZE;
+    if (first < end)
+      f(first, end - first);
+  }
+}
 
 void early_init() {
   using memory::PAGE_SIZE;
   using memory::PAGE_ALIGN;
 
+  // Make room for anything that might be handed over by
+  // `memory::reclaim_boot_memory` later on, too.
+  const auto &memory_map = memory::get_memory_map();
+  for (size_t i = 0; i < memory::get_num_memory_map_entries(); ++i) {
+    const auto &entry = memory_map[i];
+    if (entry.type == memory::memory_map_entry::usable ||
+        entry.type == memory::memory_map_entry::reclaimable)
+      max_pfn = std::max(max_pfn, (entry.base + entry.length) / PAGE_SIZE);
+  }
+  assert(max_pfn < NIL && "too many physical pages to track!");
+
+  // The page descriptors go at the bottom of the largest region.
   const auto &largest_usable_memory_map_entry = memory::get_memory_map()[0];
-  max_pages_total = largest_usable_memory_map_entry.length / PAGE_SIZE;
-   // Page align to bottom of largest available memory region
-  physical_page_map = (adt::bitmap *)kstd::align_to(
+  const auto pages_needed_for_metadata =
+      kstd::div_ceil(max_pfn * sizeof(page), PAGE_SIZE);
+  metadata_size = pages_needed_for_metadata * PAGE_SIZE;
+  const auto metadata_base = kstd::align_to(
       largest_usable_memory_map_entry.base, PAGE_ALIGN);
-  // Identity map the pages needed for the page bitmap itself
-  const auto pages_needed_for_page_map =
-      kstd::div_ceil(adt::bitmap::size_required(max_pages_total), PAGE_SIZE);
-  //const auto pages_in_page_map = max_pages_total - pages_needed_for_page_map;
-  physical_page_map =
-      paging::kernel_page_tables.identity_map_pages_into_kernel_space(
-          physical_page_map, pages_needed_for_page_map);
-  adt::bitmap::make(*physical_page_map, max_pages_total);
+  assert(metadata_base + metadata_size <=
+             largest_usable_memory_map_entry.base +
+                 largest_usable_memory_map_entry.length &&
+         "not enough memory for the page allocator's metadata!");
 
-  physical_page_base = (uintptr_t)physical_page_map +
-                       pages_needed_for_page_map * PAGE_SIZE -
-                       memory::KERNEL_VMA_OFFSET;
+  pages = (page *)memory::phys_to_virt(metadata_base);
 
-  //printf("pma : initialized %lu page(s) at 0x%p\n", pages_in_page_map,
-  //       (void*)physical_page_base);
+  for (auto &zone : zones)
+    for (auto &head : zone.free_lists)
+      head = NIL;
+  // Everything starts out reserved, until it's known to be usable memory.
+  for (uint64_t pfn = 0; pfn < max_pfn; ++pfn)
+    pages[pfn] = page{NIL, NIL, 0, page::RESERVED, 0, (zone)zone_of_pfn(pfn),
+                      page_owner::none};
+
+  const auto metadata_first_pfn = metadata_base / PAGE_SIZE;
+  const auto metadata_end_pfn = metadata_first_pfn + pages_needed_for_metadata;
+  for (auto pfn = metadata_first_pfn; pfn < metadata_end_pfn; ++pfn)
+    pages[pfn].owner = page_owner::pma;
+  for_each_usable_range([=](uint64_t first, uint64_t n) {
+    const auto end = first + n;
+    if (first <= metadata_first_pfn && metadata_first_pfn < end) {
+      add_range(first, metadata_first_pfn);
+      add_range(metadata_end_pfn, end);
+    } else {
+      add_range(first, end);
+    }
+  });
+  physical_memory_allocator_available = true;
 }
 
-void finish_init() {
-  vma::remove_from_free_list(
-      physical_page_map,
-      kstd::align_to((uintptr_t)physical_page_base + physical_page_map->size(),
-                     memory::PAGE_ALIGN));
+size_t add_free_range(uintptr_t base, size_t size) {
+  const auto first =
+      kstd::align_to(base, memory::PAGE_ALIGN) / memory::PAGE_SIZE;
+  const auto end = std::min((base + size) / memory::PAGE_SIZE, max_pfn);
+  if (first >= end)
+    return 0;
+  add_range(first, end);
+  return end - first;
 }
 
-uintptr_t get_physical_page() {
-  const auto new_page_idx = physical_page_map->find_first(FREE);
-  if (new_page_idx == -1)
+uintptr_t get_physical_page(zone highest) {
+  const auto new_page = take_cached_page(highest);
+  if (!new_page)
     kstd::panic("Allocation failed, out of physical pages!");
+  return *new_page * memory::PAGE_SIZE;
+}
 
-  physical_page_map->set(new_page_idx);
-  const auto new_page = new_page_idx * memory::PAGE_SIZE + physical_page_base;
-  assert((void *)new_page && "Top of page stack is null!");
-  return new_page;
+void get_physical_pages(size_t n, uintptr_t *out, zone highest) {
+  for (int z = (int)highest; z >= 0 && n > 0;) {
+    auto &cache = cpu_caches.zones[z];
+    if (cache.count == 0 && !refill_cache(z)) {
+      --z;
+      continue;
+    }
+    const auto count = std::min(n, cache.count);
+    for (size_t i = 0; i < count; ++i) {
+      const auto pfn = cache.pfns[--cache.count];
+      mark_allocated(pfn, 1);
+      *out++ = pfn * memory::PAGE_SIZE;
+    }
+    cpu_caches.hits += count;
+    n -= count;
+  }
+  if (n > 0)
+    kstd::panic("Allocation failed, out of physical pages!");
 }
 
-uintptr_t get_contiguous_physical_pages(size_t n) {
-  const auto new_pages_idx = physical_page_map->find_first_n(FREE, n);
-  if (new_pages_idx == -1)
+uintptr_t get_contiguous_physical_pages(size_t n, zone highest) {
+  assert(n > 0 && "trying to allocate 0 pages?");
+  const auto new_pages = allocate_pages(n, order_for(n), highest);
+  if (!new_pages)
     kstd::panic("Allocation failed, can't find %zx contiguous physical pages!",
                 n);
-  for (unsigned i = 0; i < n; ++i)
-    physical_page_map->set(new_pages_idx + i);
+  return *new_pages;
+}
+
+adt::optional<uintptr_t>
+get_aligned_contiguous_physical_pages(size_t n, kstd::Align alignment,
+                                      zone highest) {
+  assert(n > 0 && "trying to allocate 0 pages?");
+  assert(alignment.val % memory::PAGE_SIZE == 0 &&
+         "alignment must be a multiple of the page size!");
+  const auto alignment_order =
+      (unsigned)kstd::log2_floor(alignment.val / memory::PAGE_SIZE);
+  return allocate_pages(n, std::max(order_for(n), alignment_order), highest);
+}
+
+page &page_of(uintptr_t physical_address) {
+  const auto pfn = physical_address / memory::PAGE_SIZE;
+  assert(pfn < max_pfn && "no such physical page!");
+  return pages[pfn];
+}
+
+void get_page(uintptr_t physical_address) {
+  auto &p = page_of(physical_address);
+  assert(p.refcount > 0 && "taking a reference to a free page!");
+  __atomic_fetch_add(&p.refcount, 1, __ATOMIC_RELAXED);
+}
 
-  const auto new_pages = new_pages_idx * memory::PAGE_SIZE + physical_page_base;
-  assert((void *)new_pages && "Top of page stack is null!");
-  return new_pages;
+bool put_page(uintptr_t physical_address) {
+  const auto pfn = physical_address / memory::PAGE_SIZE;
+  auto &p = page_of(physical_address);
+  assert(p.refcount > 0 && "page being freed was never allocated!");
+  if (__atomic_sub_fetch(&p.refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    return false;
+  auto &cache = cpu_caches.zones[(unsigned)p.zone_id];
+  if (cache.count == CACHE_SIZE)
+    drain_cache((unsigned)p.zone_id, CACHE_BATCH);
+  cache.pfns[cache.count++] = pfn;
+  return true;
 }
 
 void free_physical_page(void *page) {
   assert(page && "Page being freed is null!");
-  const auto page_idx =
-      ((uintptr_t)page - physical_page_base) / memory::PAGE_SIZE;
-  assert(physical_page_map->test(page_idx) &&
-         "page being freed was never allocated!");
-  physical_page_map->reset(page_idx);
+  assert(page_of((uintptr_t)page).refcount == 1 &&
+         "page being freed is still shared!");
+  put_page((uintptr_t)page);
+}
+
+void free_contiguous_physical_pages(uintptr_t base, size_t n) {
+  assert(base && "Pages being freed are null!");
+  const auto first_pfn = base / memory::PAGE_SIZE;
+  assert(first_pfn + n <= max_pfn && "pages being freed don't exist!");
+  assert(pages[first_pfn].zone_id == pages[first_pfn + n - 1].zone_id &&
+         "pages being freed span more than one zone!");
+  for (auto pfn = first_pfn; pfn < first_pfn + n; ++pfn) {
+    assert(pages[pfn].refcount == 1 &&
+           "pages being freed were never allocated, or are still shared!");
+    pages[pfn].refcount = 0;
+  }
+  free_range(first_pfn, n);
+  zone_of(pages[first_pfn]).free_pages += n;
+}
+
+size_t get_free_page_count() {
+  size_t count = 0;
+  for (const auto &zone : zones)
+    count += zone.free_pages;
+  for (const auto &cache : cpu_caches.zones)
+    count += cache.count;
+  return count;
+}
+
+void dump_stats(FILE *out) {
+  for (const auto &zone : zones) {
+    if (zone.total_pages == 0)
+      continue;
+    fprintf(out, "pma: %s: %zu of %zu page(s) free, free blocks per order:",
+            zone.name, (size_t)zone.free_pages, (size_t)zone.total_pages);
+    for (unsigned order = 0; order < NUM_ORDERS; ++order)
+      fprintf(out, " %u:%zu", order, zone.free_blocks[order]);
+    fprintf(out, "\n");
+  }
+  size_t cached = 0;
+  for (const auto &cache : cpu_caches.zones)
+    cached += cache.count;
+  fprintf(out,
+          "pma: %zu page(s) cached, %zu allocation(s) from the cache, %zu "
+          "refill(s), %zu drain(s)\n",
+          cached, cpu_caches.hits, cpu_caches.refills, cpu_caches.drains);
+
+  size_t owned[(unsigned)page_owner::count] = {};
+  size_t shared = 0;
+  for (uint64_t pfn = 0; pfn < max_pfn; ++pfn) {
+    const auto &p = pages[pfn];
+    if (p.refcount == 0 && p.owner != page_owner::pma)
+      continue;
+    owned[(unsigned)p.owner] += 1;
+    if (p.refcount > 1)
+      shared += 1;
+  }
+  fprintf(out,
+          "pma: in use: %zu heap, %zu slab, %zu page table, %zu pma, %zu "
+          "other page(s), %zu shared\n",
+          owned[(unsigned)page_owner::heap], owned[(unsigned)page_owner::slab],
+          owned[(unsigned)page_owner::page_tables],
+          owned[(unsigned)page_owner::pma], owned[(unsigned)page_owner::none],
+          shared);
 }
 } // namespace pma
 
@@ -1,15 +1,101 @@
 #ifndef PMA_H
 #define PMA_H
 
+#include "util.h"
+
+#include "libadt/optional.h"
+
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 namespace pma {
+// Physical memory is split into zones by address. Allocations take a zone
+// that's the highest they can use, and are satisfied from that zone or, if
+// it's out of memory, a lower one.
+enum class zone : uint8_t {
+  // Below 16MiB, for ISA DMA.
+  dma,
+  // Below 4GiB, for devices that can only address 32 bits.
+  dma32,
+  // Everything else.
+  normal,
+};
+
+// What a page is being used for, for diagnostics.
+enum class page_owner : uint8_t {
+  none,
+  heap,
+  slab,
+  page_tables,
+  // The pma's own metadata.
+  pma,
+  count,
+};
+
+// Descriptor of a physical page. There's one for every page frame up to the
+// highest one in usable memory.
+struct page {
+  enum flag : uint8_t {
+    // Not managed by the pma: a hole in physical memory, or memory in use
+    // since before the pma was set up.
+    RESERVED = 1 << 0,
+    // The first page of a block on one of the buddy allocator's free lists.
+    BUDDY = 1 << 1,
+  };
+
+  union {
+    // Free list link, by page frame number, while the page is free.
+    uint32_t next;
+    // Number of present entries, while the page is a page table.
+    uint32_t live_entries;
+  };
+  uint32_t prev;
+  // Number of users of the page. 0 when it's free.
+  uint32_t refcount;
+  uint8_t flags;
+  // log2 of the number of pages in the free block this page starts.
+  uint8_t order;
+  zone zone_id;
+  page_owner owner;
+};
+static_assert(sizeof(page) <= 16, "keep page descriptors small!");
+
 void early_init();
-void finish_init();
-uintptr_t get_physical_page();
-uintptr_t get_contiguous_physical_pages(size_t n);
+// Hands over memory that was in use during boot, once nothing references it
+// anymore. Partial pages at either end are left out. Returns the number of
+// pages added.
+size_t add_free_range(uintptr_t base, size_t size);
+uintptr_t get_physical_page(zone highest = zone::normal);
+// Fills `out` with `n` pages, which don't have to be contiguous. Cheaper than
+// calling `get_physical_page` `n` times.
+void get_physical_pages(size_t n, uintptr_t *out, zone highest = zone::normal);
+uintptr_t get_contiguous_physical_pages(size_t n,
+                                        zone highest = zone::normal);
+// Like `get_contiguous_physical_pages`, but the first page is aligned to
+// `alignment`. Doesn't panic on failure, since callers are expected to fall
+// back to smaller allocations when physical memory is fragmented.
+adt::optional<uintptr_t>
+get_aligned_contiguous_physical_pages(size_t n, kstd::Align alignment,
+                                      zone highest = zone::normal);
+// Frees a page that isn't shared.
 void free_physical_page(void *page);
+void free_contiguous_physical_pages(uintptr_t base, size_t n);
+size_t get_free_page_count();
+
+// Descriptor of an allocated or reserved page.
+page &page_of(uintptr_t physical_address);
+// Takes another reference to an allocated page, which then stays allocated
+// until every reference has been dropped with `put_page`. Safe to call without
+// holding `alloc::malloc_lock`.
+void get_page(uintptr_t physical_address);
+// Drops a reference to a page, freeing it if that was the last one. Returns
+// whether it was freed. Must hold `alloc::malloc_lock`, unless this can't be
+// the last reference.
+bool put_page(uintptr_t physical_address);
+// Prints the number of free blocks of each buddy order in each zone, for
+// judging how fragmented physical memory is.
+void dump_stats(FILE *out);
 
 extern bool physical_memory_allocator_available;
 } // namespace pma
@@ -4,6 +4,8 @@
 #include "cmos.h"
 #include "interrupts.h"
 #include "memory.h"
+#include "mutex.h"
+#include "paging.h"
 
 #include <assert.h>
 #include <stdint.h>
@@ -19,7 +21,6 @@ static unsigned int total_tasks = 1;
 static task_context (*tasks)[MAX_TASKS] = nullptr;
 static fxsave_data *fxsave_blocks = nullptr;
 static constexpr auto TASK_STACK_SIZE = memory::PAGE_SIZE * 4;
-static constexpr auto TASK_STACK_ALIGN = kstd::Align{16};
 
 task_id get_current_task_id() { return current_task_id; }
 task_context *get_current_task() {
@@ -29,19 +30,23 @@ task_context *get_current_task() {
 void init() {
   assert(cmos::initialized() && "scheduler requires CMOS!");
 
+  // Most task slots are never used, so only pay for the ones that are: the
+  // pages backing these tables are committed as they're first written to.
   tasks = reinterpret_cast<task_context(*)[MAX_TASKS]>(
-      alloc::zeroed_array_of<task_context>(MAX_TASKS));
+      alloc::reserve(sizeof(task_context) * MAX_TASKS));
   current_task_id = KERNEL_TASK_ID;
   (*tasks)[KERNEL_TASK_ID].state = task_state::running;
 
-  fxsave_blocks = alloc::zeroed_array_of<fxsave_data>(MAX_TASKS);
+  fxsave_blocks = static_cast<fxsave_data *>(
+      alloc::reserve(sizeof(fxsave_data) * MAX_TASKS));
 
   puts("scheduler: initialized");
 }
 
 bool task_switching_enabled = false;
 bool no_scheduler_tick = false;
-static task_id schedule_task(bool is_kernel, task *new_task, void *context) {
+static task_id schedule_task(bool is_kernel, task *new_task, void *context,
+                             paging::page_tables *clone_of = nullptr) {
   // Disable interrupts while task switching
   interrupts::scoped_disable disable_interrupts;
 
@@ -61,10 +66,16 @@ static task_id schedule_task(bool is_kernel, task *new_task, void *context) {
 
   // Allocate a stack for the task, and make sure the stack pointer
   // points to the end of the buffer (stack grows downwards)
-  char *new_stack_top = (char *)alloc::alloc(TASK_STACK_SIZE, TASK_STACK_ALIGN,
-                                             alloc::protection::READ_WRITE);
+  char *new_stack_top = (char *)alloc::alloc_stack(TASK_STACK_SIZE);
   char *new_stack_base = new_stack_top + TASK_STACK_SIZE;
   task.stack_base = reinterpret_cast<void*>(new_stack_base);
+  task.address_space = nullptr;
+  if (!is_kernel) {
+    const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+    task.address_space =
+        clone_of ? paging::clone_user_space_page_tables(*clone_of)
+                 : paging::allocate_user_space_page_tables();
+  }
 
   // Put the address of exit() on the stack, so the task terminates properly
   new_stack_base -= sizeof(uintptr_t);
@@ -95,6 +106,11 @@ task_id schedule_kernel_task(task *new_task, void *context) {
 task_id schedule_user_task(task *new_task, void *context) {
   return schedule_task(/*is_kernel=*/false, new_task, context);
 }
+task_id fork_user_task(task *new_task, void *context) {
+  assert(get_current_task_is_user() && "only user tasks can be forked!");
+  return schedule_task(/*is_kernel=*/false, new_task, context,
+                       get_current_task()->address_space);
+}
 
 extern "C" void task_switch(task_frame *tcb) {
   interrupts::scoped_disable disable;
@@ -124,6 +140,9 @@ extern "C" void task_switch(task_frame *tcb) {
   *tcb = (*tasks)[next_task].frame;
 
   (*tasks)[next_task].state = task_state::running;
+  auto *address_space = (*tasks)[next_task].address_space;
+  paging::switch_to(address_space ? *address_space
+                                  : paging::kernel_page_tables);
 
   current_task_id.id = next_task;
 }
@@ -134,7 +153,15 @@ void kill(task_id id) {
     (*tasks)[id].state = task_state::killed;
     auto *stack_base = reinterpret_cast<char *>((*tasks)[id].stack_base);
     if (stack_base)
-      alloc::free(stack_base - TASK_STACK_SIZE);
+      alloc::free_stack(stack_base - TASK_STACK_SIZE, TASK_STACK_SIZE);
+    if (auto *address_space = (*tasks)[id].address_space) {
+      // A task exiting is still running in its own address space.
+      if (&paging::current_page_tables() == address_space)
+        paging::switch_to(paging::kernel_page_tables);
+      const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+      paging::free_user_space_page_tables(address_space);
+      (*tasks)[id].address_space = nullptr;
+    }
   });
 }
 
@@ -6,6 +6,10 @@
 #include "platform_specific.h"
 #include <stdint.h>
 
+namespace paging {
+class page_tables;
+}
+
 namespace scheduler {
 
 struct task_frame;
@@ -55,6 +59,9 @@ struct task_context {
   task_frame frame;
   task_state state;
   void *stack_base;
+  // The user task's own address space, or null for kernel tasks, which run in
+  // the kernel's.
+  paging::page_tables *address_space;
 };
 struct task_id {
   unsigned int id;
@@ -63,6 +70,9 @@ struct task_id {
 
 task_id schedule_user_task(task *new_task, void *context);
 task_id schedule_kernel_task(task *new_task, void *context);
+// Like `schedule_user_task`, but the new task starts out with a copy of the
+// current user task's memory, shared copy-on-write until either writes to it.
+task_id fork_user_task(task *new_task, void *context);
 
 task_id get_current_task_id();
 task_context *get_current_task();
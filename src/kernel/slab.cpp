@@ -0,0 +1,217 @@
+#include "slab.h"
+
+#include "memory.h"
+#include "paging.h"
+#include "panic.h"
+#include "pma.h"
+#include "vma.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+using memory::PAGE_SIZE;
+
+namespace slab {
+
+// Non-canonical, so it can never be mistaken for the `allocation *` the page
+// allocator writes at the start of its own pages.
+constexpr static uint64_t SLAB_MAGIC = 0x51AB51AB51AB51AB;
+
+// How many completely empty slabs each class keeps around before giving pages
+// back, so alloc/free ping-pong at a slab boundary doesn't remap every time.
+constexpr static size_t MAX_EMPTY_SLABS = 1;
+
+struct size_class;
+
+struct free_object {
+  free_object *next;
+};
+
+// Header at the start of every slab page. The objects follow directly after
+// it, so its size also determines the alignment of every object.
+struct slab_page {
+  uint64_t magic;
+  size_class *cls;
+  slab_page *prev;
+  slab_page *next;
+  free_object *free_list;
+  uint32_t in_use;
+  uint32_t capacity;
+  uint64_t reserved[2];
+};
+static_assert(sizeof(slab_page) == 64, "slab header should be a cacheline");
+static_assert(sizeof(slab_page) % MAX_OBJECT_ALIGN == 0,
+              "slab header breaks object alignment!");
+
+struct size_class {
+  size_t object_size;
+  // Slabs with at least one free object. Full slabs aren't tracked, they're
+  // relinked once one of their objects is freed.
+  slab_page *partial;
+  size_t empty_slabs;
+
+  size_t slabs;
+  size_t objects_in_use;
+  size_t peak_objects_in_use;
+  size_t total_allocations;
+
+  uint32_t capacity() const {
+    return (PAGE_SIZE - sizeof(slab_page)) / object_size;
+  }
+};
+
+static size_class classes[] = {
+    {16}, {32}, {64}, {128}, {256}, {512}, {1024}, {MAX_OBJECT_SIZE},
+};
+
+static size_class &class_for(size_t n) {
+  for (auto &cls : classes)
+    if (n <= cls.object_size)
+      return cls;
+  kstd::panic("no size class for %zu byte object!", n);
+}
+
+static slab_page *slab_of(const void *p) {
+  return reinterpret_cast<slab_page *>((uintptr_t)p & -PAGE_SIZE);
+}
+
+static void link(size_class &cls, slab_page *slab) {
+  slab->prev = nullptr;
+  slab->next = cls.partial;
+  if (cls.partial)
+    cls.partial->prev = slab;
+  cls.partial = slab;
+}
+
+static void unlink(size_class &cls, slab_page *slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    cls.partial = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->prev = slab->next = nullptr;
+}
+
+static slab_page *new_slab(size_class &cls) {
+  const auto physical_page = pma::get_physical_page();
+  pma::page_of(physical_page).owner = pma::page_owner::slab;
+  const auto virtual_page = vma::get_virtual_pages(PAGE_SIZE);
+  auto *slab = static_cast<slab_page *>(
+      paging::kernel_page_tables.map_page(physical_page, virtual_page));
+
+  *slab = slab_page{};
+  slab->magic = SLAB_MAGIC;
+  slab->cls = &cls;
+  slab->capacity = cls.capacity();
+
+  // Thread the free list back to front, so objects get handed out in address
+  // order.
+  char *objects = reinterpret_cast<char *>(slab + 1);
+  for (auto i = slab->capacity; i > 0; --i) {
+    auto *object =
+        reinterpret_cast<free_object *>(objects + (i - 1) * cls.object_size);
+    object->next = slab->free_list;
+    slab->free_list = object;
+  }
+
+  link(cls, slab);
+  cls.slabs += 1;
+  cls.empty_slabs += 1;
+  return slab;
+}
+
+static void release_slab(size_class &cls, slab_page *slab) {
+  unlink(cls, slab);
+  cls.slabs -= 1;
+
+  const auto physical_page =
+      paging::kernel_page_tables.get_physical_address(slab);
+  slab->magic = 0;
+  paging::kernel_page_tables.unmap_page(slab);
+  pma::free_physical_page((void *)physical_page);
+  vma::free_virtual_pages(slab, PAGE_SIZE);
+}
+
+void *alloc(size_t n) {
+  assert(n <= MAX_OBJECT_SIZE && "object too large for a slab!");
+  auto &cls = class_for(n);
+
+  slab_page *slab = cls.partial;
+  if (!slab)
+    slab = new_slab(cls);
+  if (slab->in_use == 0)
+    cls.empty_slabs -= 1;
+
+  free_object *object = slab->free_list;
+  assert(object && "partial slab has no free objects?");
+  slab->free_list = object->next;
+  if (++slab->in_use == slab->capacity)
+    unlink(cls, slab);
+
+  cls.total_allocations += 1;
+  if (++cls.objects_in_use > cls.peak_objects_in_use)
+    cls.peak_objects_in_use = cls.objects_in_use;
+
+  return object;
+}
+
+void free(void *p) {
+  slab_page *slab = slab_of(p);
+  assert(slab->magic == SLAB_MAGIC && "bad free: not a slab object!");
+  auto &cls = *slab->cls;
+  assert(((uintptr_t)p - (uintptr_t)(slab + 1)) % cls.object_size == 0 &&
+         "bad free: pointer isn't the start of a slab object!");
+  assert(slab->in_use > 0 && "bad free: slab has no objects in use!");
+
+  if (slab->in_use == slab->capacity)
+    link(cls, slab);
+
+  auto *object = static_cast<free_object *>(p);
+  object->next = slab->free_list;
+  slab->free_list = object;
+  slab->in_use -= 1;
+  cls.objects_in_use -= 1;
+
+  if (slab->in_use == 0) {
+    if (cls.empty_slabs >= MAX_EMPTY_SLABS)
+      release_slab(cls, slab);
+    else
+      cls.empty_slabs += 1;
+  }
+}
+
+bool owns(const void *p) {
+  // Objects always follow the slab header, so they're never page-aligned.
+  // Page-aligned pointers can only come from the page allocator.
+  if ((uintptr_t)p % PAGE_SIZE == 0)
+    return false;
+  return slab_of(p)->magic == SLAB_MAGIC;
+}
+
+size_t object_size(const void *p) {
+  assert(owns(p) && "not a slab object!");
+  return slab_of(p)->cls->object_size;
+}
+
+void dump_stats(FILE *out) {
+  size_t total_slabs = 0;
+  size_t total_objects = 0;
+  for (const auto &cls : classes) {
+    const auto capacity = cls.slabs * cls.capacity();
+    fprintf(out,
+            "slab %zuB: %zu slab(s), %zu/%zu object(s) in use (%zu%%), "
+            "peak %zu, %zu alloc(s)\n",
+            cls.object_size, cls.slabs, cls.objects_in_use, capacity,
+            capacity ? cls.objects_in_use * 100 / capacity : 0,
+            cls.peak_objects_in_use, cls.total_allocations);
+    total_slabs += cls.slabs;
+    total_objects += cls.objects_in_use;
+  }
+  // Without slabs, every one of these objects would've taken at least a page.
+  fprintf(out, "slab: %zu page(s) back %zu object(s), saving %zu page(s)\n",
+          total_slabs, total_objects,
+          total_objects > total_slabs ? total_objects - total_slabs : 0);
+}
+
+} // namespace slab
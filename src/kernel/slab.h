@@ -0,0 +1,38 @@
+#ifndef KERNEL_SLAB_H
+#define KERNEL_SLAB_H
+
+#include "util.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+// Size-class allocator for small kernel objects. Objects of the same class are
+// carved out of shared pages (slabs), so small allocations don't each cost a
+// page, a page table update and an `invlpg`.
+//
+// None of these functions lock: they're expected to be called with
+// `alloc::malloc_lock` held.
+namespace slab {
+
+// Largest object that's served from a size class. Bigger (or more strictly
+// aligned) requests should go to the page allocator instead.
+constexpr static size_t MAX_OBJECT_SIZE = 2016;
+constexpr static auto MAX_OBJECT_ALIGN = kstd::Align{16};
+
+inline bool serves(size_t n, kstd::Align alignment) {
+  return n != 0 && n <= MAX_OBJECT_SIZE && alignment <= MAX_OBJECT_ALIGN;
+}
+
+void *alloc(size_t n);
+void free(void *p);
+
+// Whether `p` was handed out by `slab::alloc`.
+bool owns(const void *p);
+// Size of the size class `p` was allocated from.
+size_t object_size(const void *p);
+
+void dump_stats(FILE *out);
+
+} // namespace slab
+
+#endif
@@ -2,6 +2,7 @@
 
 #include "pit.h"
 #include "scheduler.h"
+#include "util.h"
 
 const static auto ticks_per_second =
     (uint64_t)1193182; // TODO document where this came from (see PIT)
@@ -33,6 +34,25 @@ void init_timer() { init_pit(); }
 uint64_t get_millis_since_start() { return millis_since_start; }
 uint64_t get_micros_since_start() { return micros_since_start; }
 
+uint64_t get_tsc_cycles_per_milli() {
+  constexpr static uint64_t CALIBRATION_MILLIS = 10;
+  static uint64_t tsc_cycles_per_milli = 0;
+  if (tsc_cycles_per_milli != 0)
+    return tsc_cycles_per_milli;
+
+  // Start right at a millisecond boundary, so the PIT's granularity doesn't
+  // skew the measurement.
+  const auto start = get_millis_since_start();
+  while (get_millis_since_start() == start)
+    asm volatile("pause" ::: "memory");
+  const auto begin_millis = get_millis_since_start();
+  const auto begin_tsc = rdtsc();
+  while (get_millis_since_start() - begin_millis < CALIBRATION_MILLIS)
+    asm volatile("pause" ::: "memory");
+  tsc_cycles_per_milli = (rdtsc() - begin_tsc) / CALIBRATION_MILLIS;
+  return tsc_cycles_per_milli;
+}
+
 void busy_sleep(microseconds us) {
   const auto begin = get_micros_since_start();
   while (get_micros_since_start() - begin < us.val)
@@ -8,6 +8,9 @@ void tick();
 void init_timer();
 
 uint64_t get_millis_since_start();
+// How many TSC cycles pass per millisecond. Calibrated against the PIT on the
+// first call, which takes around 10ms and needs the timer running.
+uint64_t get_tsc_cycles_per_milli();
 
 struct microseconds {
   uint64_t val = 0;
@@ -66,4 +66,10 @@ inline cpuid_info cpuid(uint32_t code) {
   return cpuid_info{eax, ebx, ecx, edx};
 }
 
+inline uint64_t rdtsc() {
+  uint32_t lo, hi;
+  asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  return (uint64_t)lo | ((uint64_t)hi << 32);
+}
+
 #endif
@@ -0,0 +1,152 @@
+#ifndef KERNEL_UTIL_ARENA_H
+#define KERNEL_UTIL_ARENA_H
+
+#include "alloc.h"
+#include "memory.h"
+#include "util.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace kstd {
+
+// Bump allocator for allocations that all die at the same time (e.g. during a
+// single boot phase or shell command). Memory is carved out of large chunks
+// taken from `alloc::alloc`, and only given back all at once, by `reset` or
+// when the arena is destroyed. Individual frees are no-ops.
+//
+// Like the rest of the kernel's allocators, an arena doesn't lock: it should
+// only be used from one task at a time.
+class arena {
+  struct chunk {
+    chunk *prev;
+    size_t size;
+  };
+
+  chunk *current = nullptr;
+  uintptr_t cursor = 0;
+  uintptr_t end = 0;
+  size_t chunk_size;
+
+  size_t bytes_in_use = 0;
+  size_t num_chunks = 0;
+
+  size_t regular_chunk_size() const {
+    return align_to(chunk_size, memory::PAGE_ALIGN);
+  }
+
+  void new_chunk() {
+    const auto size = regular_chunk_size();
+    auto *c = static_cast<chunk *>(
+        alloc::alloc(size, memory::PAGE_ALIGN, alloc::READ_WRITE));
+    *c = chunk{current, size};
+    current = c;
+    cursor = (uintptr_t)(c + 1);
+    end = (uintptr_t)c + size;
+    num_chunks += 1;
+  }
+
+  // Oversized requests get a chunk of their own. It's linked in behind the
+  // current chunk, so what's left of that is still used for the next
+  // allocations.
+  void *new_dedicated_chunk(size_t n, Align alignment) {
+    const auto offset = align_to(sizeof(chunk), alignment);
+    const auto size = align_to(offset + n, memory::PAGE_ALIGN);
+    auto *c = static_cast<chunk *>(
+        alloc::alloc(size, memory::PAGE_ALIGN, alloc::READ_WRITE));
+    if (current) {
+      *c = chunk{current->prev, size};
+      current->prev = c;
+    } else {
+      // Nothing to put it behind: it becomes the current chunk, with no room
+      // left in it.
+      *c = chunk{nullptr, size};
+      current = c;
+      cursor = end = (uintptr_t)c + size;
+    }
+    num_chunks += 1;
+    bytes_in_use += n;
+    return (char *)c + offset;
+  }
+
+  void free_chunks_after(chunk *last) {
+    while (current != last) {
+      chunk *prev = current->prev;
+      alloc::free(current);
+      current = prev;
+      num_chunks -= 1;
+    }
+  }
+
+public:
+  constexpr static size_t DEFAULT_CHUNK_SIZE = 0x10 * memory::PAGE_SIZE;
+
+  explicit arena(size_t chunk_size = DEFAULT_CHUNK_SIZE)
+      : chunk_size{chunk_size} {}
+  ~arena() { free_chunks_after(nullptr); }
+
+  arena(const arena &) = delete;
+  arena &operator=(const arena &) = delete;
+
+  void *allocate(size_t n, Align alignment = Align{alignof(max_align_t)}) {
+    auto p = align_to(cursor, alignment);
+    if (!current || p + n > end) {
+      if (align_to(sizeof(chunk), alignment) + n > chunk_size)
+        return new_dedicated_chunk(n, alignment);
+      new_chunk();
+      p = align_to(cursor, alignment);
+    }
+    assert(p + n <= end && "arena chunk too small for allocation?");
+    cursor = p + n;
+    bytes_in_use += n;
+    return (void *)p;
+  }
+
+  template <typename T, Align A = align_of<T>> T *array_of(size_t n) {
+    return (T *)allocate(sizeof(T) * n, A);
+  }
+
+  // Frees everything allocated from the arena. One regular chunk is kept
+  // around, so an arena that's reset after every use doesn't keep going back
+  // to the page allocator. Oversized chunks are always given back.
+  void reset() {
+    chunk *kept = nullptr;
+    while (current) {
+      chunk *prev = current->prev;
+      if (!kept && current->size == regular_chunk_size()) {
+        kept = current;
+      } else {
+        alloc::free(current);
+        num_chunks -= 1;
+      }
+      current = prev;
+    }
+    current = kept;
+    if (kept) {
+      kept->prev = nullptr;
+      cursor = (uintptr_t)(kept + 1);
+      end = (uintptr_t)kept + kept->size;
+    } else {
+      cursor = end = 0;
+    }
+    bytes_in_use = 0;
+  }
+
+  size_t allocated_bytes() const { return bytes_in_use; }
+  size_t chunk_count() const { return num_chunks; }
+};
+
+// Adapts an arena with static storage duration to `kstd::allocator`, e.g.
+// `adt::hash_map<K, V, kstd::allocator<kstd::arena_alloc<my_arena>>>`.
+template <arena &A> struct arena_alloc {
+  static void *allocate(size_t n, Align alignment) {
+    return A.allocate(n, alignment);
+  }
+  // Memory is only given back when the arena is reset.
+  static void deallocate(void *, Align) {}
+};
+
+} // namespace kstd
+
+#endif
@@ -11,7 +11,6 @@ namespace vga {
 
 const cursor null_cursor = {.x = -1, .y = -1};
 
-constexpr auto VGA_MEMORY_BASE_ADDRESS = 0xB8000;
 auto *VGA_MEMORY = (uint16_t*)VGA_MEMORY_BASE_ADDRESS;
 
 static void write_color_char_at(uint16_t *base, cursor pos, const char c, color fg,
@@ -99,10 +98,16 @@ void string::print_char(char c) {
 
 bool initialized = false;
 void init() {
-  // Identity map the entire VGA buffer.
-  paging::kernel_page_tables.identity_map_page_range_into_kernel_space(
-      VGA_MEMORY_BASE_ADDRESS, SCREEN_HEIGHT * SCREEN_WIDTH * sizeof(uint16_t));
-  current_screen.lock()->clear();
+  // Move the screen from the low identity mapping of the VGA buffer to its
+  // own mapping in the MMIO window. The screen is mostly written to, so let
+  // the writes be combined rather than each going out on its own.
+  VGA_MEMORY = (uint16_t *)paging::map_mmio(
+      VGA_MEMORY_BASE_ADDRESS, VGA_MEMORY_SIZE,
+      paging::attributes::RW | paging::attributes::XD |
+          paging::attributes::WRITE_COMBINING);
+  auto screen = current_screen.lock();
+  *screen = vga::screen{VGA_MEMORY};
+  screen->clear();
   initialized = true;
 }
 
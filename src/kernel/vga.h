@@ -2,6 +2,10 @@
 #define VGA_H
 
 #include "mutex.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
 namespace vga {
 
 enum class color : unsigned char {
@@ -25,6 +29,9 @@ enum class color : unsigned char {
 
 constexpr auto SCREEN_WIDTH = 80;
 constexpr auto SCREEN_HEIGHT = 25;
+constexpr auto VGA_MEMORY_BASE_ADDRESS = 0xB8000;
+constexpr auto VGA_MEMORY_SIZE =
+    SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(uint16_t);
 
 struct cursor {
   int x = 0;
@@ -7,6 +7,8 @@
 #include "util.h"
 #include "panic.h"
 
+#include "libadt/range_tree.h"
+
 #include <assert.h>
 
 using memory::PAGE_SIZE;
@@ -21,154 +23,175 @@ constexpr static uintptr_t MIN_NEGATIVE_VIRTUAL_ADDR =
 constexpr static uintptr_t MAX_NEGATIVE_VIRTUAL_ADDR = (uintptr_t)-1;
 
 namespace vma {
-struct free_node {
-  void *base;
-  size_t size;
-  free_node *next;
-};
-
-free_node *virtual_free_list = nullptr;
-size_t free_list_size = 0;
-size_t max_free_list_size = 0;
-constexpr auto NODES_PER_PAGE = PAGE_SIZE / sizeof(free_node);
-
-static void add_node_to_free_list(void *base, size_t size) {
-  free_node *node = nullptr;
-  free_node *last = nullptr;
-  free_node *empty_node = nullptr;
-
-  // Walk free list, looking for nodes to merge or re-use with if possible
-  for (node = virtual_free_list, last = node; node != nullptr;
-       last = node, node = node->next) {
-    // Keep track of empty nodes to re-use in case we can't merge
-    if (empty_node == nullptr && node->size == 0) {
-      empty_node = node;
-      continue;
-    }
-    const auto end_of_current_node =
-        reinterpret_cast<uintptr_t>(node->base) + node->size - 1;
-    const auto end_of_new_node = reinterpret_cast<uintptr_t>(base) + size - 1;
-    // If the area to be freed is just before an existing free node,
-    // move the base of the node to the base of the free area and
-    // increase the node's size accordingly
-    if ((uintptr_t)node->base - 1 == end_of_new_node) {
-      node->base = base;
-      node->size += size;
-      return;
-    }
-    // If the area to be freed is at the end of an existing free node,
-    // just increase the size of the free node
-    else if ((uintptr_t)base - 1 == end_of_current_node) {
-      node->size += size;
-      return;
-    }
-  }
+// Free ranges of the heap region, which `get_virtual_pages` allocates from.
+static adt::range_tree heap_ranges;
+// Free ranges of everything outside the dedicated regions. Nothing allocates
+// from these: they're only here so that fixed mappings (e.g. identity
+// mappings) can be claimed.
+static adt::range_tree other_ranges;
+// Operations on a tree take at most one node each, so keeping a couple spare
+// means growing never runs out part way through.
+constexpr static size_t MIN_SPARE_NODES = 2;
+
+static bool in_heap(const void *base, size_t size) {
+  const auto start = reinterpret_cast<uintptr_t>(base);
+  return start >= memory::HEAP_START && start < memory::HEAP_END &&
+         size <= memory::HEAP_END - start;
+}
 
-  // Otherwise, there are no nodes to merge with. If we have an empty node to
-  // re-use, do so now, else create a new node after the last to store the free
-  // area.
-  if (empty_node == nullptr) {
-    empty_node = last + 1;
-    last->next = empty_node;
+static adt::range_tree &tree_for(const void *base, size_t size) {
+  return in_heap(base, size) ? heap_ranges : other_ranges;
+}
 
-    // TODO: grow the free list when it hits max_free_list_size
-    ++free_list_size;
-    assert(free_list_size != max_free_list_size && "No more free nodes!");
-  }
-  *empty_node = free_node{base, size, nullptr};
+// Maps a fresh page of nodes for `tree`. The page's own address comes out of
+// the heap region: heap ranges are page aligned, so taking a page from the
+// front of one never has to split it, and never needs a node of its own.
+static void grow_node_storage(adt::range_tree &tree) {
+  const auto physical_address = pma::get_physical_page();
+  const auto virtual_address = heap_ranges.allocate(PAGE_SIZE, PAGE_SIZE);
+  if (!virtual_address)
+    kstd::panic("vma: out of virtual pages for the free range tree!");
+  auto *storage = paging::kernel_page_tables.map_page(
+      physical_address, reinterpret_cast<void *>(*virtual_address));
+  tree.add_node_storage(storage, PAGE_SIZE);
 }
 
-void remove_from_free_list(void *base, size_t size) {
-  assert(virtual_free_list && "free list is empty?");
+static void ensure_spare_nodes(adt::range_tree &tree) {
+  if (tree.spare_nodes() < MIN_SPARE_NODES)
+    grow_node_storage(tree);
+}
+
+bool try_claim(void *base, size_t size) {
   size = kstd::align_to(size, PAGE_ALIGN);
-  for (auto node = virtual_free_list; node != nullptr; node = node->next) {
-    const auto end_of_node =
-        reinterpret_cast<char *>(node->base) + node->size - 1;
-    const auto end_of_area = reinterpret_cast<char *>(base) + size - 1;
-    if (base >= node->base && end_of_area <= end_of_node) {
-      // Split node
-      const auto remaining_front_size = reinterpret_cast<uintptr_t>(base) -
-                                        reinterpret_cast<uintptr_t>(node->base);
-      const auto remaining_end_size = end_of_node - end_of_area;
-      node->size = remaining_front_size;
-      add_node_to_free_list(end_of_area + 1, remaining_end_size);
-      return;
-    }
-  }
-  kstd::panic("couldn't find region from %p to %p in free list: was it "
-              "already freed?",
-              base, (char *)base + size);
+  auto &tree = tree_for(base, size);
+  ensure_spare_nodes(tree);
+  return tree.try_claim(reinterpret_cast<uintptr_t>(base), size);
+}
+
+void remove_from_free_list(void *base, size_t size) {
+  if (!try_claim(base, size))
+    kstd::panic("couldn't find region from %p to %p in free list: was it "
+                "already freed?",
+                base, (char *)base + size);
 }
 
 void init() {
-  // Identity map a page for the virtual free list to reside in
-  virtual_free_list = reinterpret_cast<free_node *>(pma::get_physical_page());
-  virtual_free_list =
-      paging::kernel_page_tables.identity_map_page_into_kernel_space(
-          virtual_free_list);
-
-  max_free_list_size = NODES_PER_PAGE;
-
-  // Initial null entry
-  virtual_free_list->base = 0;
-  virtual_free_list->size = 0;
-  virtual_free_list->next = nullptr;
-
-  const auto mark_free_range = [](intptr_t start, intptr_t end) {
-    if (start < end)
-      add_node_to_free_list((void *)start, (size_t)(end - start + 1));
-    else
-      add_node_to_free_list((void *)end, (size_t)(start - end + 1));
+  // The first page of nodes comes through the physmap, since there's nothing
+  // to allocate virtual addresses from yet. That's plenty for the initial
+  // ranges, after which the heap region can provide more.
+  auto *storage = memory::phys_to_virt(pma::get_physical_page());
+  other_ranges.add_node_storage(storage, PAGE_SIZE / 2);
+  heap_ranges.add_node_storage((char *)storage + PAGE_SIZE / 2, PAGE_SIZE / 2);
+
+  const auto mark_free_range = [](adt::range_tree &tree, uintptr_t start,
+                                  uintptr_t last) {
+    tree.insert(start, last - start + 1);
   };
 
   // FFFF'FFFF'8010'0000 - FFFF'FFFF'8020'0000 is mapped for kernel
   // 0000'0000'0000'0000 - 0000'0000'0020'0000 is identity mapped
+  // FFFF'FC00'0000'0000 - FFFF'FF00'0000'0000 is split into dedicated regions
   //
-  // Hence 0000'0000'0020'0000 - FFFF'FFFF'8010'0000 is free,
+  // Hence 0000'0000'0020'0000 - 0000'03FF'FFFF'FFFF is free,
+  //       FFFF'FF00'0000'0000 - FFFF'FFFF'8010'0000 is free,
   //   and FFFF'FFFF'8020'0000 - FFFF'FFFF'FFFF'FFFF is free.
   //
-  mark_free_range(0x200000, MAX_POSITIVE_VIRTUAL_ADDR);
-  mark_free_range(MIN_NEGATIVE_VIRTUAL_ADDR, memory::KERNEL_VMA_START - 1);
-  mark_free_range(memory::KERNEL_VMA_END, MAX_NEGATIVE_VIRTUAL_ADDR);
-
-  // Remove the identity page used by the virtual free list
-  remove_from_free_list(virtual_free_list, PAGE_SIZE);
+  mark_free_range(other_ranges, 0x200000, MAX_POSITIVE_VIRTUAL_ADDR);
+  mark_free_range(other_ranges, memory::MMIO_END,
+                  memory::KERNEL_VMA_START - 1);
+  mark_free_range(other_ranges, memory::KERNEL_VMA_END,
+                  MAX_NEGATIVE_VIRTUAL_ADDR);
+  mark_free_range(heap_ranges, memory::HEAP_START, memory::HEAP_END - 1);
   puts("vma: initialized");
 }
 
 void *get_virtual_pages(size_t size) {
+  return get_virtual_pages(size, PAGE_ALIGN);
+}
+
+void *get_virtual_pages(size_t size, kstd::Align alignment) {
   assert(size != 0 && "Tried to allocate page of size 0!");
   assert(size % PAGE_SIZE == 0 && "size must be page-aligned!");
-
-  // Walk the free list for a node of appropriate size.
-  for (free_node *node = virtual_free_list; node != nullptr;
-       node = node->next) {
-    // Found a node big enough
-    if (node->size >= size) {
-      // Adjust the remaining size in the node
-      const auto free_page_address = node->base;
-      const auto end_of_requested_area =
-          reinterpret_cast<uintptr_t>(node->base) + size;
-      node->base = reinterpret_cast<void *>(end_of_requested_area);
-      node->size -= size;
-      return free_page_address;
-    }
-  }
-  kstd::panic("Allocation failed, out of virtual pages!");
+  assert(alignment.val % PAGE_SIZE == 0 &&
+         "alignment must be a multiple of the page size!");
+
+  ensure_spare_nodes(heap_ranges);
+  const auto address = heap_ranges.allocate(size, alignment.val);
+  if (!address)
+    kstd::panic("Allocation failed, out of virtual pages! (wanted %zx bytes, "
+                "largest free range is %zx)",
+                size, heap_ranges.largest_range());
+  return reinterpret_cast<void *>(*address);
 }
 
 void free_virtual_pages(void *address, size_t size) {
   assert(address != nullptr && "Tried to free page at 0x0!");
   assert(size != 0 && "Tried to free page of size 0!");
-  add_node_to_free_list(address, size);
+  auto &tree = tree_for(address, size);
+  ensure_spare_nodes(tree);
+  tree.insert(reinterpret_cast<uintptr_t>(address), size);
 }
 
-void dump_free_list() {
-  fprintf(stderr, "dumping VMA free list:\n");
-  for (free_node *node = virtual_free_list; node != nullptr;
-       node = node->next) {
-    fprintf(stderr, "-- node: %p - %p (%zx)\n", node->base,
-            (char *)node->base + node->size - 1, node->size);
+static void dump_ranges(const char *name, const adt::range_tree &tree) {
+  fprintf(stderr, "dumping VMA %s free list (%zu range(s), %zu spare node(s)):\n",
+          name, tree.range_count(), tree.spare_nodes());
+  tree.for_each([](uintptr_t base, size_t size) {
+    fprintf(stderr, "-- node: %p - %p (%zx)\n", (void *)base,
+            (void *)(base + size - 1), size);
+  });
+}
+
+// Which stack slots are in use.
+constexpr static size_t MAX_STACKS = 1024;
+static_assert(MAX_STACKS * STACK_SLOT_SIZE <=
+                  memory::STACKS_END - memory::STACKS_START,
+              "stack slots don't fit in their region!");
+static uint64_t stack_slots_used[MAX_STACKS / 64];
+static size_t stacks_in_use = 0;
+
+void *get_stack(size_t size) {
+  assert(size != 0 && size % PAGE_SIZE == 0 &&
+         "stack size must be a non-zero number of pages!");
+  assert(size <= MAX_STACK_SIZE && "stack doesn't fit in a slot!");
+  for (size_t i = 0; i < MAX_STACKS / 64; ++i) {
+    if (stack_slots_used[i] == ~0ULL)
+      continue;
+    const auto bit = __builtin_ctzll(~stack_slots_used[i]);
+    stack_slots_used[i] |= 1ULL << bit;
+    stacks_in_use += 1;
+    const auto slot = memory::STACKS_START + (i * 64 + bit) * STACK_SLOT_SIZE;
+    return reinterpret_cast<void *>(slot + STACK_SLOT_SIZE - size);
   }
+  kstd::panic("vma: out of stack slots!");
+}
+
+void free_stack(void *stack) {
+  const auto address = reinterpret_cast<uintptr_t>(stack);
+  assert(address >= memory::STACKS_START &&
+         address < memory::STACKS_START + MAX_STACKS * STACK_SLOT_SIZE &&
+         "not a stack!");
+  const auto slot = (address - memory::STACKS_START) / STACK_SLOT_SIZE;
+  assert((stack_slots_used[slot / 64] & (1ULL << (slot % 64))) &&
+         "stack was already freed!");
+  stack_slots_used[slot / 64] &= ~(1ULL << (slot % 64));
+  stacks_in_use -= 1;
+}
+
+static uintptr_t next_mmio_address = memory::MMIO_START;
+
+void *get_mmio_pages(size_t size) {
+  size = kstd::align_to(size, PAGE_ALIGN);
+  if (size > memory::MMIO_END - next_mmio_address)
+    kstd::panic("vma: out of MMIO address space!");
+  const auto address = next_mmio_address;
+  next_mmio_address += size;
+  return reinterpret_cast<void *>(address);
+}
+
+void dump_free_list() {
+  dump_ranges("heap", heap_ranges);
+  dump_ranges("other", other_ranges);
+  fprintf(stderr, "VMA: %zu stack slot(s) in use, %zx bytes of MMIO mapped\n",
+          stacks_in_use, (size_t)(next_mmio_address - memory::MMIO_START));
 }
 } // namespace vma
@@ -1,14 +1,36 @@
 #ifndef VMA_H
 #define VMA_H
 
+#include "util.h"
+
 #include <stddef.h>
 
 namespace vma {
 void init();
+// Allocates from the kernel heap region.
 void *get_virtual_pages(size_t size);
+// Like `get_virtual_pages`, but the returned base is aligned to `alignment`.
+void *get_virtual_pages(size_t size, kstd::Align alignment);
 void free_virtual_pages(void *address, size_t size);
 void remove_from_free_list(void *base, size_t size);
+// Takes [base, base + size) off the free list if all of it is free, and
+// returns whether it was.
+bool try_claim(void *base, size_t size);
 void dump_free_list();
+
+// Kernel stacks each get a fixed-size slot in the stacks region. Only the top
+// of a slot is ever mapped, so there's always at least a page of unmapped
+// guard below every stack, and overflowing one faults instead of corrupting
+// its neighbour.
+constexpr static size_t STACK_SLOT_SIZE = 0x10000;
+constexpr static size_t MAX_STACK_SIZE = STACK_SLOT_SIZE - 0x1000;
+// Returns the lowest address of a `size` byte stack at the top of a free slot.
+void *get_stack(size_t size);
+void free_stack(void *stack);
+
+// Takes `size` bytes of the MMIO window, for mapping device memory. Device
+// mappings live as long as the kernel does, so these are never freed.
+void *get_mmio_pages(size_t size);
 } // namespace vma
 
 #endif
@@ -0,0 +1,94 @@
+#include "zero_pool.h"
+
+#include "alloc.h"
+#include "memory.h"
+#include "mutex.h"
+#include "pma.h"
+#include "scheduler.h"
+#include "timing.h"
+#include "util.h"
+
+#include <algorithm>
+
+using memory::PAGE_SIZE;
+
+namespace zero_pool {
+
+// 1MiB of zeroed memory. The task starts refilling once the pool drops below
+// the low watermark, and then tops it up all the way, a batch at a time.
+constexpr static size_t POOL_SIZE = 0x100;
+constexpr static size_t LOW_WATERMARK = POOL_SIZE / 2;
+constexpr static size_t REFILL_BATCH = 0x10;
+
+static uintptr_t pool[POOL_SIZE];
+static size_t pool_count = 0;
+
+static uint64_t hits = 0;
+static uint64_t misses = 0;
+static uint64_t pages_zeroed = 0;
+static uint64_t zeroing_cycles = 0;
+
+adt::optional<uintptr_t> take() {
+  if (pool_count == 0) {
+    misses += 1;
+    return adt::none;
+  }
+  hits += 1;
+  return pool[--pool_count];
+}
+
+static void refill_batch() {
+  uintptr_t batch[REFILL_BATCH];
+  size_t batch_count = 0;
+  {
+    const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+    batch_count = std::min(REFILL_BATCH, POOL_SIZE - pool_count);
+    pma::get_physical_pages(batch_count, batch);
+  }
+
+  // The pages are cleared through the physmap, and nobody else has them yet,
+  // so the clearing itself doesn't need to hold up anyone else's allocations.
+  for (size_t i = 0; i < batch_count; ++i) {
+    const auto start = rdtsc();
+    memory::zero_pages(memory::phys_to_virt(batch[i]), 1);
+    zeroing_cycles += rdtsc() - start;
+  }
+
+  const kstd::mutex::guard lock = alloc::malloc_lock.lock();
+  for (size_t i = 0; i < batch_count; ++i)
+    pool[pool_count++] = batch[i];
+  pages_zeroed += batch_count;
+}
+
+static void refill_task(void *) {
+  // Calibrate now, rather than the first time the stats are printed.
+  get_tsc_cycles_per_milli();
+  while (true) {
+    if (pool_count < LOW_WATERMARK) {
+      while (pool_count < POOL_SIZE)
+        refill_batch();
+    }
+    busy_sleep(10_ms);
+  }
+}
+
+void start() {
+  scheduler::schedule_kernel_task(&refill_task, nullptr);
+}
+
+void dump_stats(FILE *out) {
+  const auto requests = hits + misses;
+  fprintf(out, "zero pool: %zu/%zu page(s), %lu hit(s), %lu miss(es) (%lu%%)\n",
+          pool_count, POOL_SIZE, hits, misses,
+          requests ? hits * 100 / requests : 0);
+
+  const auto cycles_per_milli = get_tsc_cycles_per_milli();
+  const auto bytes_zeroed = pages_zeroed * PAGE_SIZE;
+  // bytes / (cycles / cycles-per-ms) = bytes per ms, which is also KB/s.
+  const auto kb_per_second =
+      zeroing_cycles ? bytes_zeroed * cycles_per_milli / zeroing_cycles : 0;
+  fprintf(out, "zero pool: %lu page(s) zeroed, refilling at %lu MB/s\n",
+          pages_zeroed, kb_per_second / 1000);
+}
+
+} // namespace zero_pool
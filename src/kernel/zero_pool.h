@@ -0,0 +1,25 @@
+#ifndef KERNEL_ZERO_POOL_H
+#define KERNEL_ZERO_POOL_H
+
+#include "libadt/optional.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// A stock of physical pages that have already been zeroed, kept topped up by
+// a background kernel task, so zeroed allocations don't have to clear memory
+// on the caller's time.
+namespace zero_pool {
+
+// Schedules the refill task. Must run after `scheduler::init`.
+void start();
+
+// Takes a zeroed physical page from the pool, if there are any left. Must be
+// called with `alloc::malloc_lock` held.
+adt::optional<uintptr_t> take();
+
+void dump_stats(FILE *out);
+
+} // namespace zero_pool
+
+#endif
@@ -2,10 +2,19 @@
 #define LIBADT_INTRUSIVE_BITMAP_H
 
 #include "util.h"
+
+#include <bit>
 #include <stdint.h>
 
 namespace adt {
 
+// Bitmap laid out in-place at the start of a caller-provided buffer of
+// `size_required(num_bits)` bytes.
+//
+// Besides the bits themselves, it keeps a summary level with one bit per limb,
+// set when every bit in that limb is set. Searches for clear bits skip over
+// full limbs 64 at a time, so they stay fast even when the bitmap is nearly
+// full.
 class bitmap {
   bitmap() = delete;
 
@@ -13,86 +22,211 @@ public:
   using limb_type = uint64_t;
   constexpr static auto BYTES_PER_LIMB = sizeof(limb_type);
   constexpr static auto BITS_PER_LIMB = BYTES_PER_LIMB * 8;
+  constexpr static limb_type FULL_LIMB = ~(limb_type)0;
 
   static void make(bitmap &out, uint64_t num_bits) {
-    out.num_limbs = kstd::div_ceil(num_bits, BITS_PER_LIMB);
-    out.total_size = out.num_limbs * sizeof(limb_type);
-    for (unsigned i = 0; i < out.num_limbs; ++i)
+    out.num_bits = num_bits;
+    out.num_limbs = kstd::div_ceil(num_bits, (uint64_t)BITS_PER_LIMB);
+    out.num_summary_limbs =
+        kstd::div_ceil(out.num_limbs, (uint64_t)BITS_PER_LIMB);
+    out.total_size = size_required(num_bits);
+    out.first_free_summary_hint = 0;
+    for (uint64_t i = 0; i < out.num_limbs + out.num_summary_limbs; ++i)
       out.limbs[i] = 0;
+    // Summary bits past the last limb count as full, so searches never pick
+    // a limb that isn't there.
+    if (const auto used = out.num_limbs % BITS_PER_LIMB)
+      out.summary()[out.num_summary_limbs - 1] = ~(((limb_type)1 << used) - 1);
   }
 
   static uint64_t size_required(uint64_t num_bits) {
-    return kstd::div_ceil(num_bits, BITS_PER_LIMB) * sizeof(limb_type);
+    const auto num_limbs = kstd::div_ceil(num_bits, (uint64_t)BITS_PER_LIMB);
+    const auto num_summary_limbs =
+        kstd::div_ceil(num_limbs, (uint64_t)BITS_PER_LIMB);
+    return sizeof(bitmap) + (num_limbs + num_summary_limbs) * BYTES_PER_LIMB;
+  }
+
+  bool test(uint64_t idx) const {
+    return (limbs[idx / BITS_PER_LIMB] & bit_in_limb(idx)) != 0;
   }
 
-  bool test(unsigned idx) const {
-    return (limbs[idx / BITS_PER_LIMB] & (1ULL << (idx % BITS_PER_LIMB))) != 0;
+  void set(uint64_t idx) {
+    const auto limb = idx / BITS_PER_LIMB;
+    limbs[limb] |= bit_in_limb(idx);
+    update_summary(limb);
   }
 
-  void set(unsigned idx) {
-    limbs[idx / BITS_PER_LIMB] |= 1ULL << (idx % BITS_PER_LIMB);
+  void reset(uint64_t idx) {
+    const auto limb = idx / BITS_PER_LIMB;
+    limbs[limb] &= ~bit_in_limb(idx);
+    update_summary(limb);
   }
 
-  void reset(unsigned idx) {
-    limbs[idx / BITS_PER_LIMB] &= ~(1ULL << (idx % BITS_PER_LIMB));
+  // Sets or clears the `n` bits starting at `start`, a whole limb at a time.
+  void set_range(uint64_t start, uint64_t n) { assign_range(start, n, true); }
+  void reset_range(uint64_t start, uint64_t n) {
+    assign_range(start, n, false);
   }
 
-  int find_first(bool v) const {
-    const limb_type empty = v ? 0 : ~0;
-    for (unsigned i = 0; i < num_limbs; ++i) {
-      if (limbs[i] == empty)
+  // Whether all `n` bits starting at `start` are equal to `v`.
+  bool test_range(uint64_t start, uint64_t n, bool v) const {
+    const auto end = start + n;
+    while (start < end) {
+      const auto limb = start / BITS_PER_LIMB;
+      const auto mask = range_mask(start, end);
+      if ((matches(limb, v) & mask) != mask)
+        return false;
+      start = (limb + 1) * BITS_PER_LIMB;
+    }
+    return true;
+  }
+
+  // Index of the first bit equal to `v`, or -1 if there isn't one.
+  int64_t find_first(bool v) const {
+    if (v) {
+      for (uint64_t i = 0; i < num_limbs; ++i)
+        if (const auto m = matches(i, true))
+          return i * BITS_PER_LIMB + std::countr_zero(m);
+      return -1;
+    }
+
+    // Every summary limb before the hint is known to be full.
+    for (uint64_t s = first_free_summary_hint; s < num_summary_limbs; ++s) {
+      const auto not_full = ~summary()[s];
+      if (not_full == 0) {
+        first_free_summary_hint = s + 1;
         continue;
-      for (unsigned bit = 0; bit < BITS_PER_LIMB; ++bit)
-        if ((bool)(limbs[i] & (1 << bit)) == v)
-          return BITS_PER_LIMB * i + bit;
+      }
+      first_free_summary_hint = s;
+      const auto limb = s * BITS_PER_LIMB + std::countr_zero(not_full);
+      if (const auto m = matches(limb, false))
+        return limb * BITS_PER_LIMB + std::countr_zero(m);
+      // Only the last limb can be non-full without having a valid clear bit,
+      // since the bits past `num_bits` in it are never set.
     }
     return -1;
   }
 
-  int find_first_n(bool v, unsigned n) const {
-    const limb_type empty = v ? 0 : ~0;
-    unsigned num_contiguous = 0;
-    int start_idx = -1;
-    for (unsigned i = 0; i < size(); ++i) {
-      if (num_contiguous >= n)
-        return start_idx;
-      if (limbs[i / BITS_PER_LIMB] == empty) {
-        i += BITS_PER_LIMB - 1;
-        num_contiguous = 0;
-        start_idx = -1;
+  // Index of the first run of `n` bits equal to `v` that starts at or after
+  // `from`, or -1 if there isn't one.
+  int64_t find_first_n(bool v, uint64_t n, uint64_t from = 0) const {
+    if (n == 0)
+      return from;
+
+    uint64_t run_start = 0;
+    uint64_t run_length = 0;
+    for (uint64_t limb = from / BITS_PER_LIMB; limb < num_limbs; ++limb) {
+      // Looking for clear bits, a full summary limb rules out 64 limbs at once.
+      if (!v && limb % BITS_PER_LIMB == 0 &&
+          summary()[limb / BITS_PER_LIMB] == FULL_LIMB) {
+        run_length = 0;
+        limb += BITS_PER_LIMB - 1;
         continue;
       }
-      if (limbs[i / BITS_PER_LIMB] == ~empty) {
-        i += BITS_PER_LIMB - 1;
-        num_contiguous += BITS_PER_LIMB;
-        if (start_idx == -1)
-          start_idx = i;
+
+      auto m = matches(limb, v);
+      if (limb == from / BITS_PER_LIMB)
+        m &= ~(bit_in_limb(from) - 1);
+      if (m == FULL_LIMB) {
+        if (run_length == 0)
+          run_start = limb * BITS_PER_LIMB;
+        run_length += BITS_PER_LIMB;
+        if (run_length >= n)
+          return run_start;
         continue;
       }
-      unsigned j = i % BITS_PER_LIMB;
-      for (; j < BITS_PER_LIMB && (i + j) < size(); ++j) {
-        if (test(i + j) != v) {
-          num_contiguous = 0;
-          start_idx = -1;
-          continue;
+      if (m == 0) {
+        run_length = 0;
+        continue;
+      }
+
+      unsigned bit = 0;
+      while (bit < BITS_PER_LIMB) {
+        const auto rest = m >> bit;
+        if (rest & 1) {
+          // `rest` has zeroes shifted in at the top, so this is always found.
+          const unsigned ones = std::countr_zero(~rest);
+          if (run_length == 0)
+            run_start = limb * BITS_PER_LIMB + bit;
+          run_length += ones;
+          if (run_length >= n)
+            return run_start;
+          bit += ones;
+        } else {
+          run_length = 0;
+          if (rest == 0)
+            break;
+          bit += std::countr_zero(rest);
         }
-        ++num_contiguous;
-        if (start_idx == -1)
-          start_idx = i + j;
-        if (num_contiguous >= n)
-          return start_idx;
       }
-      i += BITS_PER_LIMB - (i % BITS_PER_LIMB) - 1;
     }
     return -1;
   }
 
   uint64_t size() const { return total_size; }
+  uint64_t bit_count() const { return num_bits; }
 
 private:
-  uint32_t num_limbs;
-  uint32_t total_size;
-  uint64_t limbs[];
+  static limb_type bit_in_limb(uint64_t idx) {
+    return (limb_type)1 << (idx % BITS_PER_LIMB);
+  }
+
+  // Mask of the bits in [start, end) that fall into the limb containing
+  // `start`.
+  static limb_type range_mask(uint64_t start, uint64_t end) {
+    const auto limb_start = start / BITS_PER_LIMB * BITS_PER_LIMB;
+    const auto from = start - limb_start;
+    const auto to =
+        end - limb_start >= BITS_PER_LIMB ? BITS_PER_LIMB : end - limb_start;
+    const auto upper = to == BITS_PER_LIMB ? FULL_LIMB
+                                           : ((limb_type)1 << to) - 1;
+    return upper & ~(((limb_type)1 << from) - 1);
+  }
+
+  limb_type *summary() { return limbs + num_limbs; }
+  const limb_type *summary() const { return limbs + num_limbs; }
+
+  // Bits of `limb` equal to `v`, leaving out any past the end of the bitmap.
+  limb_type matches(uint64_t limb, bool v) const {
+    auto m = v ? limbs[limb] : ~limbs[limb];
+    if (limb == num_limbs - 1 && num_bits % BITS_PER_LIMB != 0)
+      m &= ((limb_type)1 << (num_bits % BITS_PER_LIMB)) - 1;
+    return m;
+  }
+
+  void update_summary(uint64_t limb) {
+    const auto s = limb / BITS_PER_LIMB;
+    if (limbs[limb] == FULL_LIMB) {
+      summary()[s] |= bit_in_limb(limb);
+    } else {
+      summary()[s] &= ~bit_in_limb(limb);
+      if (s < first_free_summary_hint)
+        first_free_summary_hint = s;
+    }
+  }
+
+  void assign_range(uint64_t start, uint64_t n, bool v) {
+    const auto end = start + n;
+    while (start < end) {
+      const auto limb = start / BITS_PER_LIMB;
+      const auto mask = range_mask(start, end);
+      if (v)
+        limbs[limb] |= mask;
+      else
+        limbs[limb] &= ~mask;
+      update_summary(limb);
+      start = (limb + 1) * BITS_PER_LIMB;
+    }
+  }
+
+  uint64_t num_bits;
+  uint64_t num_limbs;
+  uint64_t num_summary_limbs;
+  uint64_t total_size;
+  // Summary limbs before this one are all full. Only ever a lower bound on
+  // where the first clear bit is, so searching from it is always correct.
+  mutable uint64_t first_free_summary_hint;
+  limb_type limbs[];
 };
 
 } // namespace adt
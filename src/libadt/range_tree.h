@@ -0,0 +1,334 @@
+#ifndef LIBADT_RANGE_TREE_H
+#define LIBADT_RANGE_TREE_H
+
+#include "./optional.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace adt {
+
+// Set of disjoint [base, base + size) ranges, e.g. the free parts of an address
+// space. Ranges that touch are always merged into one.
+//
+// Ranges are kept in an AVL tree ordered by address, where every node also
+// records the size of the largest range in its subtree. Allocating can then
+// skip any subtree that's too small, and find the lowest-addressed range that
+// fits in O(log n). Inserting (and merging) and claiming are O(log n) too.
+//
+// That bound only holds for unaligned allocations. Subtrees are skipped by
+// size alone, so an aligned allocation still walks ranges that are big enough
+// but have no room once aligned, and is O(n) at worst.
+//
+// The tree doesn't allocate on its own: nodes are carved out of memory handed
+// over with `add_node_storage`. Every operation needs at most one spare node,
+// so callers should keep `spare_nodes` topped up before calling in.
+//
+// Ranges may go all the way up to the end of the address space, so the ends
+// of ranges are always handled as the last address in them.
+class range_tree {
+public:
+  struct node {
+    uintptr_t base;
+    size_t size;
+    // Size of the largest range in this subtree.
+    size_t max_size;
+    node *left;
+    node *right;
+    int height;
+
+    uintptr_t last() const { return base + size - 1; }
+  };
+
+  range_tree() = default;
+  range_tree(const range_tree &) = delete;
+  range_tree &operator=(const range_tree &) = delete;
+
+  void add_node_storage(void *storage, size_t bytes) {
+    auto *nodes = static_cast<node *>(storage);
+    for (size_t i = 0; i < bytes / sizeof(node); ++i)
+      release_node(&nodes[i]);
+  }
+
+  size_t spare_nodes() const { return num_spare_nodes; }
+  size_t range_count() const { return num_ranges; }
+  size_t largest_range() const { return max_size_of(root); }
+
+  // Adds [base, base + size), which mustn't overlap anything already in the
+  // tree, merging it with the ranges right before and after it.
+  void insert(uintptr_t base, size_t size) {
+    assert(size != 0 && "inserting an empty range?");
+    const auto last = base + size - 1;
+    node *before = find_last_starting_at_or_before(base);
+    node *after = before ? next_after(before->base) : first();
+    assert((!before || before->last() < base) && "ranges overlap!");
+    assert((!after || last < after->base) && "ranges overlap!");
+
+    const bool merge_before = before && before->last() + 1 == base;
+    const bool merge_after = after && last + 1 == after->base;
+    if (merge_before && merge_after) {
+      const auto merged_size = before->size + size + after->size;
+      root = remove(root, after->base);
+      release_node(after);
+      num_ranges -= 1;
+      before->size = merged_size;
+      root = refresh(root, before->base);
+    } else if (merge_before) {
+      before->size += size;
+      root = refresh(root, before->base);
+    } else if (merge_after) {
+      // Moving the base down keeps it ordered, since it can't reach `before`.
+      after->base = base;
+      after->size += size;
+      root = refresh(root, after->base);
+    } else {
+      root = insert(root, new_node(base, size));
+      num_ranges += 1;
+    }
+  }
+
+  // Takes [base, base + size) out of the tree if all of it is in there, and
+  // returns whether it was.
+  bool try_claim(uintptr_t base, size_t size) {
+    assert(size != 0 && "claiming an empty range?");
+    node *n = find_last_starting_at_or_before(base);
+    if (!n || n->last() < base + size - 1 || base + size - 1 < base)
+      return false;
+    carve(n, base, size);
+    return true;
+  }
+
+  // Takes `size` bytes, starting at a multiple of `alignment`, out of the
+  // lowest-addressed range that has room for them. O(log n) when `alignment`
+  // is 1, and O(n) at worst otherwise.
+  optional<uintptr_t> allocate(size_t size, size_t alignment = 1) {
+    assert(size != 0 && "allocating an empty range?");
+    assert(alignment != 0 && "alignment must be non-zero!");
+    node *n = find_fit(root, size, alignment);
+    if (!n)
+      return none;
+    const auto start = align_up(n->base, alignment);
+    carve(n, start, size);
+    return start;
+  }
+
+  // Calls `f(base, size)` for each range, in address order.
+  template <typename F> void for_each(F &&f) const { for_each(root, f); }
+
+private:
+  static int height_of(const node *n) { return n ? n->height : 0; }
+  static size_t max_size_of(const node *n) { return n ? n->max_size : 0; }
+
+  static uintptr_t align_up(uintptr_t v, size_t alignment) {
+    return (v + alignment - 1) / alignment * alignment;
+  }
+
+  // Whether `n` has room for `size` bytes starting at a multiple of
+  // `alignment`.
+  static bool fits(const node *n, size_t size, size_t alignment) {
+    const auto start = align_up(n->base, alignment);
+    // Also catches `start` wrapping around past the end of the range.
+    return start >= n->base && start - n->base < n->size &&
+           n->size - (start - n->base) >= size;
+  }
+
+  static void update(node *n) {
+    const auto lh = height_of(n->left);
+    const auto rh = height_of(n->right);
+    n->height = (lh > rh ? lh : rh) + 1;
+    auto max_size = n->size;
+    if (max_size_of(n->left) > max_size)
+      max_size = max_size_of(n->left);
+    if (max_size_of(n->right) > max_size)
+      max_size = max_size_of(n->right);
+    n->max_size = max_size;
+  }
+
+  static node *rotate_left(node *n) {
+    node *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    update(n);
+    update(r);
+    return r;
+  }
+
+  static node *rotate_right(node *n) {
+    node *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    update(n);
+    update(l);
+    return l;
+  }
+
+  static node *balance(node *n) {
+    update(n);
+    const auto factor = height_of(n->left) - height_of(n->right);
+    if (factor > 1) {
+      if (height_of(n->left->left) < height_of(n->left->right))
+        n->left = rotate_left(n->left);
+      return rotate_right(n);
+    }
+    if (factor < -1) {
+      if (height_of(n->right->right) < height_of(n->right->left))
+        n->right = rotate_right(n->right);
+      return rotate_left(n);
+    }
+    return n;
+  }
+
+  static node *insert(node *n, node *new_node) {
+    if (!n)
+      return new_node;
+    if (new_node->base < n->base)
+      n->left = insert(n->left, new_node);
+    else
+      n->right = insert(n->right, new_node);
+    return balance(n);
+  }
+
+  // Unlinks the leftmost node of `n`'s subtree into `min`.
+  static node *remove_min(node *n, node *&min) {
+    if (!n->left) {
+      min = n;
+      return n->right;
+    }
+    n->left = remove_min(n->left, min);
+    return balance(n);
+  }
+
+  // Unlinks the node starting at `base`. Nodes are relinked rather than having
+  // their contents moved around, so pointers to the other nodes stay valid.
+  static node *remove(node *n, uintptr_t base) {
+    assert(n && "removing a range that isn't in the tree!");
+    if (base < n->base) {
+      n->left = remove(n->left, base);
+      return balance(n);
+    }
+    if (base > n->base) {
+      n->right = remove(n->right, base);
+      return balance(n);
+    }
+    if (!n->left || !n->right)
+      return n->left ? n->left : n->right;
+    node *successor;
+    node *right = remove_min(n->right, successor);
+    successor->left = n->left;
+    successor->right = right;
+    return balance(successor);
+  }
+
+  // Recomputes the augmented sizes along the path to the node starting at
+  // `base`, after its size changed.
+  static node *refresh(node *n, uintptr_t base) {
+    assert(n && "refreshing a range that isn't in the tree!");
+    if (base < n->base)
+      n->left = refresh(n->left, base);
+    else if (base > n->base)
+      n->right = refresh(n->right, base);
+    update(n);
+    return n;
+  }
+
+  static node *find_fit(node *n, size_t size, size_t alignment) {
+    if (!n || n->max_size < size)
+      return nullptr;
+    if (node *in_left = find_fit(n->left, size, alignment))
+      return in_left;
+    if (fits(n, size, alignment))
+      return n;
+    return find_fit(n->right, size, alignment);
+  }
+
+  template <typename F> static void for_each(const node *n, F &f) {
+    if (!n)
+      return;
+    for_each(n->left, f);
+    f(n->base, n->size);
+    for_each(n->right, f);
+  }
+
+  node *find_last_starting_at_or_before(uintptr_t address) const {
+    node *found = nullptr;
+    for (node *n = root; n;) {
+      if (n->base <= address) {
+        found = n;
+        n = n->right;
+      } else {
+        n = n->left;
+      }
+    }
+    return found;
+  }
+
+  node *next_after(uintptr_t address) const {
+    node *found = nullptr;
+    for (node *n = root; n;) {
+      if (n->base > address) {
+        found = n;
+        n = n->left;
+      } else {
+        n = n->right;
+      }
+    }
+    return found;
+  }
+
+  node *first() const {
+    node *n = root;
+    while (n && n->left)
+      n = n->left;
+    return n;
+  }
+
+  // Takes [start, start + size) out of `n`, which has to contain it, keeping
+  // whatever's left on either side.
+  void carve(node *n, uintptr_t start, size_t size) {
+    const auto front = start - n->base;
+    const auto back = n->last() - (start + size - 1);
+    if (front == 0 && back == 0) {
+      root = remove(root, n->base);
+      release_node(n);
+      num_ranges -= 1;
+    } else if (front == 0) {
+      // Moving the base up keeps it ordered, since it stays inside `n`.
+      n->base = start + size;
+      n->size = back;
+      root = refresh(root, n->base);
+    } else {
+      n->size = front;
+      root = refresh(root, n->base);
+      if (back != 0) {
+        root = insert(root, new_node(start + size, back));
+        num_ranges += 1;
+      }
+    }
+  }
+
+  node *new_node(uintptr_t base, size_t size) {
+    assert(spare_nodes_list && "out of range tree nodes!");
+    node *n = spare_nodes_list;
+    spare_nodes_list = n->left;
+    num_spare_nodes -= 1;
+    *n = node{base, size, size, nullptr, nullptr, 1};
+    return n;
+  }
+
+  void release_node(node *n) {
+    n->left = spare_nodes_list;
+    spare_nodes_list = n;
+    num_spare_nodes += 1;
+  }
+
+  node *root = nullptr;
+  size_t num_ranges = 0;
+  // Spare nodes are kept in a list threaded through `left`.
+  node *spare_nodes_list = nullptr;
+  size_t num_spare_nodes = 0;
+};
+
+} // namespace adt
+
+#endif
@@ -0,0 +1,196 @@
+#include <gtest/gtest.h>
+
+#include "libadt/intrusive_bitmap.h"
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+namespace {
+
+// Owns a buffer big enough for an intrusive bitmap of `num_bits` bits.
+struct bitmap_storage {
+  std::unique_ptr<uint64_t[]> buffer;
+  adt::bitmap *map;
+
+  explicit bitmap_storage(uint64_t num_bits)
+      : buffer{new uint64_t[adt::bitmap::size_required(num_bits) /
+                            sizeof(uint64_t)]},
+        map{reinterpret_cast<adt::bitmap *>(buffer.get())} {
+    adt::bitmap::make(*map, num_bits);
+  }
+
+  adt::bitmap *operator->() { return map; }
+};
+
+constexpr uint64_t PAGE_SIZE = 0x1000;
+constexpr uint64_t GiB = 1ULL << 30;
+
+} // namespace
+
+TEST(bitmap, find_first_past_bit_31) {
+  bitmap_storage map{128};
+  map->set_range(0, 40);
+  EXPECT_EQ(map->find_first(false), 40);
+  EXPECT_EQ(map->find_first(true), 0);
+}
+
+TEST(bitmap, find_first_skips_full_limbs) {
+  bitmap_storage map{64 * 64 * 3};
+  map->set_range(0, 64 * 64 * 2 + 5);
+  EXPECT_EQ(map->find_first(false), 64 * 64 * 2 + 5);
+  map->reset(77);
+  EXPECT_EQ(map->find_first(false), 77);
+}
+
+TEST(bitmap, find_first_ignores_bits_past_the_end) {
+  bitmap_storage map{70};
+  map->set_range(0, 70);
+  EXPECT_EQ(map->find_first(false), -1);
+  map->reset(69);
+  EXPECT_EQ(map->find_first(false), 69);
+}
+
+TEST(bitmap, find_first_on_full_bitmaps_of_whole_limbs) {
+  for (const uint64_t num_bits : {64, 128, 192}) {
+    bitmap_storage map{num_bits};
+    map->set_range(0, num_bits);
+    EXPECT_EQ(map->find_first(false), -1) << num_bits << " bits";
+    EXPECT_EQ(map->find_first_n(false, 1), -1) << num_bits << " bits";
+    map->reset(num_bits - 1);
+    EXPECT_EQ(map->find_first(false), (int64_t)num_bits - 1)
+        << num_bits << " bits";
+  }
+}
+
+TEST(bitmap, set_and_reset_range_across_limbs) {
+  bitmap_storage map{300};
+  map->set_range(10, 200);
+  for (uint64_t i = 0; i < 300; ++i)
+    EXPECT_EQ(map->test(i), i >= 10 && i < 210) << i;
+  EXPECT_TRUE(map->test_range(10, 200, true));
+  EXPECT_FALSE(map->test_range(9, 200, true));
+  EXPECT_TRUE(map->test_range(210, 90, false));
+
+  map->reset_range(64, 64);
+  EXPECT_TRUE(map->test_range(64, 64, false));
+  EXPECT_TRUE(map->test_range(10, 54, true));
+  EXPECT_TRUE(map->test_range(128, 82, true));
+}
+
+TEST(bitmap, find_first_n_finds_runs) {
+  bitmap_storage map{1024};
+  map->set_range(0, 1024);
+  map->reset_range(100, 10);
+  map->reset_range(300, 200);
+  EXPECT_EQ(map->find_first_n(false, 10), 100);
+  EXPECT_EQ(map->find_first_n(false, 11), 300);
+  EXPECT_EQ(map->find_first_n(false, 200), 300);
+  EXPECT_EQ(map->find_first_n(false, 201), -1);
+  EXPECT_EQ(map->find_first_n(false, 10, 101), 300);
+  EXPECT_EQ(map->find_first_n(false, 64, 310), 310);
+  EXPECT_EQ(map->find_first_n(true, 100), 0);
+  EXPECT_EQ(map->find_first_n(true, 101), 110);
+  EXPECT_EQ(map->find_first_n(true, 191), 500);
+}
+
+TEST(bitmap, find_first_n_doesnt_run_past_the_end) {
+  bitmap_storage map{100};
+  map->set_range(0, 90);
+  EXPECT_EQ(map->find_first_n(false, 10), 90);
+  EXPECT_EQ(map->find_first_n(false, 11), -1);
+}
+
+TEST(bitmap, matches_naive_search) {
+  constexpr uint64_t BITS = 5000;
+  bitmap_storage map{BITS};
+  std::vector<bool> naive(BITS);
+  std::mt19937 rng{1234};
+  for (int round = 0; round < 2000; ++round) {
+    const auto start = rng() % BITS;
+    const auto n = 1 + rng() % std::min<uint64_t>(200, BITS - start);
+    const bool v = rng() % 3 != 0;
+    if (v)
+      map->set_range(start, n);
+    else
+      map->reset_range(start, n);
+    for (auto i = start; i < start + n; ++i)
+      naive[i] = v;
+
+    const auto want = 1 + rng() % 64;
+    int64_t expected = -1;
+    for (uint64_t i = 0, run = 0; i < BITS; ++i) {
+      run = naive[i] ? 0 : run + 1;
+      if (run == want) {
+        expected = i + 1 - want;
+        break;
+      }
+    }
+    ASSERT_EQ(map->find_first_n(false, want), expected) << round;
+
+    int64_t first_clear = -1;
+    for (uint64_t i = 0; i < BITS; ++i)
+      if (!naive[i]) {
+        first_clear = i;
+        break;
+      }
+    ASSERT_EQ(map->find_first(false), first_clear) << round;
+  }
+}
+
+// Allocates every page but the last few of a machine with `memory` bytes of
+// RAM, one page at a time, the way `pma::get_physical_page` does. Without the
+// summary level, each search would rescan everything allocated so far.
+static void bench_fill(uint64_t memory) {
+  const auto pages = memory / PAGE_SIZE;
+  bitmap_storage map{pages};
+  constexpr uint64_t SAMPLE = 1 << 16;
+  // Pre-fill most of it in bulk, so only the expensive (nearly-full) end of
+  // the range gets timed.
+  map->set_range(0, pages - SAMPLE);
+
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < SAMPLE; ++i) {
+    const auto idx = map->find_first(false);
+    ASSERT_EQ((uint64_t)idx, pages - SAMPLE + i);
+    map->set(idx);
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  EXPECT_EQ(map->find_first(false), -1);
+
+  const auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  printf("bitmap: %llu GiB (%llu pages): %.1f ns per find_first+set\n",
+         (unsigned long long)(memory / GiB), (unsigned long long)pages,
+         (double)ns / SAMPLE);
+}
+
+// Frees pages scattered across a nearly full machine, then searches for
+// contiguous 2MiB runs.
+static void bench_find_run(uint64_t memory) {
+  const auto pages = memory / PAGE_SIZE;
+  bitmap_storage map{pages};
+  map->set_range(0, pages);
+  std::mt19937 rng{42};
+  for (int i = 0; i < 1000; ++i)
+    map->reset(rng() % pages);
+  map->reset_range(pages - 512, 512);
+
+  constexpr int ROUNDS = 10;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < ROUNDS; ++i)
+    ASSERT_EQ((uint64_t)map->find_first_n(false, 512), pages - 512);
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  const auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  printf("bitmap: %llu GiB: %.1f us per 2MiB run search\n",
+         (unsigned long long)(memory / GiB), (double)ns / ROUNDS / 1000);
+}
+
+TEST(bitmap_bench, fill_1GiB) { bench_fill(1 * GiB); }
+TEST(bitmap_bench, fill_16GiB) { bench_fill(16 * GiB); }
+TEST(bitmap_bench, fill_64GiB) { bench_fill(64 * GiB); }
+TEST(bitmap_bench, find_run_1GiB) { bench_find_run(1 * GiB); }
+TEST(bitmap_bench, find_run_16GiB) { bench_find_run(16 * GiB); }
+TEST(bitmap_bench, find_run_64GiB) { bench_find_run(64 * GiB); }
@@ -0,0 +1,238 @@
+#include <gtest/gtest.h>
+
+#include "libadt/range_tree.h"
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr uintptr_t PAGE_SIZE = 0x1000;
+
+// A range tree with plenty of nodes to go around.
+struct tree_with_storage {
+  std::unique_ptr<adt::range_tree::node[]> storage;
+  adt::range_tree tree;
+
+  explicit tree_with_storage(size_t num_nodes = 1024)
+      : storage{new adt::range_tree::node[num_nodes]} {
+    tree.add_node_storage(storage.get(),
+                          num_nodes * sizeof(adt::range_tree::node));
+  }
+
+  adt::range_tree *operator->() { return &tree; }
+
+  std::vector<std::pair<uintptr_t, size_t>> ranges() {
+    std::vector<std::pair<uintptr_t, size_t>> out;
+    tree.for_each([&](uintptr_t base, size_t size) {
+      out.emplace_back(base, size);
+    });
+    return out;
+  }
+};
+
+using ranges = std::vector<std::pair<uintptr_t, size_t>>;
+
+} // namespace
+
+TEST(range_tree, insert_merges_neighbours) {
+  tree_with_storage tree;
+  tree->insert(0x1000, 0x1000);
+  tree->insert(0x5000, 0x1000);
+  EXPECT_EQ(tree.ranges(), (ranges{{0x1000, 0x1000}, {0x5000, 0x1000}}));
+
+  tree->insert(0x2000, 0x1000);
+  EXPECT_EQ(tree.ranges(), (ranges{{0x1000, 0x2000}, {0x5000, 0x1000}}));
+
+  tree->insert(0x4000, 0x1000);
+  EXPECT_EQ(tree.ranges(), (ranges{{0x1000, 0x2000}, {0x4000, 0x2000}}));
+
+  tree->insert(0x3000, 0x1000);
+  EXPECT_EQ(tree.ranges(), (ranges{{0x1000, 0x5000}}));
+  EXPECT_EQ(tree->range_count(), 1);
+}
+
+TEST(range_tree, allocate_is_lowest_first_fit) {
+  tree_with_storage tree;
+  tree->insert(0x10000, 0x1000);
+  tree->insert(0x20000, 0x4000);
+  tree->insert(0x30000, 0x10000);
+
+  EXPECT_EQ(tree->allocate(0x2000), adt::optional<uintptr_t>{0x20000});
+  EXPECT_EQ(tree->allocate(0x1000), adt::optional<uintptr_t>{0x10000});
+  EXPECT_EQ(tree->allocate(0x8000), adt::optional<uintptr_t>{0x30000});
+  EXPECT_EQ(tree->allocate(0x9000), adt::none);
+  EXPECT_EQ(tree.ranges(), (ranges{{0x22000, 0x2000}, {0x38000, 0x8000}}));
+  EXPECT_EQ(tree->largest_range(), 0x8000);
+}
+
+TEST(range_tree, aligned_allocate_splits_range) {
+  tree_with_storage tree;
+  tree->insert(0x1000, 0x400000);
+
+  EXPECT_EQ(tree->allocate(0x200000, 0x200000),
+            adt::optional<uintptr_t>{0x200000});
+  EXPECT_EQ(tree.ranges(), (ranges{{0x1000, 0x1ff000}, {0x400000, 0x1000}}));
+  EXPECT_EQ(tree->allocate(0x200000, 0x200000), adt::none);
+  EXPECT_EQ(tree->allocate(0x1000, 0x400000),
+            adt::optional<uintptr_t>{0x400000});
+}
+
+TEST(range_tree, interleaved_aligned_allocations) {
+  tree_with_storage tree;
+  tree->insert(0x1000, 0x100000);
+
+  EXPECT_EQ(tree->allocate(0x1000), adt::optional<uintptr_t>{0x1000});
+  EXPECT_EQ(tree->allocate(0x1000, 0x10000),
+            adt::optional<uintptr_t>{0x10000});
+  EXPECT_EQ(tree->allocate(0x2000), adt::optional<uintptr_t>{0x2000});
+  // The range before 0x10000 is big enough, but has no 64KiB boundary in it.
+  EXPECT_EQ(tree->allocate(0x1000, 0x10000),
+            adt::optional<uintptr_t>{0x20000});
+  EXPECT_EQ(tree->allocate(0x1000, 0x8000), adt::optional<uintptr_t>{0x8000});
+  tree->insert(0x10000, 0x1000);
+  EXPECT_EQ(tree->allocate(0x1000, 0x10000),
+            adt::optional<uintptr_t>{0x10000});
+  EXPECT_EQ(tree.ranges(), (ranges{{0x4000, 0x4000},
+                                   {0x9000, 0x7000},
+                                   {0x11000, 0xf000},
+                                   {0x21000, 0xe0000}}));
+}
+
+TEST(range_tree, try_claim) {
+  tree_with_storage tree;
+  tree->insert(0x1000, 0x9000);
+
+  EXPECT_TRUE(tree->try_claim(0x4000, 0x2000));
+  EXPECT_EQ(tree.ranges(), (ranges{{0x1000, 0x3000}, {0x6000, 0x4000}}));
+  EXPECT_FALSE(tree->try_claim(0x3000, 0x2000));
+  EXPECT_FALSE(tree->try_claim(0x0, 0x1000));
+  EXPECT_TRUE(tree->try_claim(0x1000, 0x3000));
+  EXPECT_TRUE(tree->try_claim(0x9000, 0x1000));
+  EXPECT_EQ(tree.ranges(), (ranges{{0x6000, 0x3000}}));
+}
+
+TEST(range_tree, handles_the_top_of_the_address_space) {
+  tree_with_storage tree;
+  const uintptr_t top = UINTPTR_MAX - 0x3000 + 1;
+  tree->insert(top, 0x3000);
+  EXPECT_FALSE(tree->try_claim(UINTPTR_MAX - 0xfff, 0x2000));
+  EXPECT_TRUE(tree->try_claim(UINTPTR_MAX - 0xfff, 0x1000));
+  tree->insert(UINTPTR_MAX - 0xfff, 0x1000);
+  EXPECT_EQ(tree.ranges(), (ranges{{top, 0x3000}}));
+  EXPECT_EQ(tree->allocate(0x1000, 0x10000), adt::none);
+  EXPECT_EQ(tree->allocate(0x3000), adt::optional<uintptr_t>{top});
+  EXPECT_EQ(tree->range_count(), 0);
+}
+
+TEST(range_tree, recycles_nodes) {
+  tree_with_storage tree{4};
+  tree->insert(0x0, 0x100000);
+  for (int i = 0; i < 1000; ++i) {
+    const auto a = tree->allocate(PAGE_SIZE);
+    const auto b = tree->allocate(PAGE_SIZE);
+    ASSERT_TRUE(a && b);
+    tree->insert(*a, PAGE_SIZE);
+    tree->insert(*b, PAGE_SIZE);
+  }
+  EXPECT_EQ(tree->range_count(), 1);
+  EXPECT_EQ(tree->spare_nodes(), 3);
+}
+
+// Checks the tree against a plain map of free ranges, under a random mix of
+// allocations and frees.
+TEST(range_tree, matches_naive_free_list) {
+  tree_with_storage tree{4096};
+  constexpr uintptr_t BASE = 0x100000;
+  constexpr size_t PAGES = 1024;
+  tree->insert(BASE, PAGES * PAGE_SIZE);
+  std::vector<bool> used(PAGES);
+  std::vector<std::pair<uintptr_t, size_t>> live;
+  std::mt19937 rng{1234};
+
+  for (int round = 0; round < 5000; ++round) {
+    if (live.empty() || rng() % 2) {
+      const size_t pages = 1 + rng() % 16;
+      const size_t alignment = PAGE_SIZE << (rng() % 4);
+      int64_t expected = -1;
+      for (size_t i = 0; i + pages <= PAGES; ++i) {
+        if ((BASE + i * PAGE_SIZE) % alignment)
+          continue;
+        size_t j = 0;
+        while (j < pages && !used[i + j])
+          ++j;
+        if (j == pages) {
+          expected = i;
+          break;
+        }
+      }
+      const auto got = tree->allocate(pages * PAGE_SIZE, alignment);
+      if (expected < 0) {
+        ASSERT_FALSE(got) << round;
+        continue;
+      }
+      ASSERT_EQ(got, adt::optional<uintptr_t>{BASE + expected * PAGE_SIZE})
+          << round;
+      for (size_t j = 0; j < pages; ++j)
+        used[expected + j] = true;
+      live.emplace_back(*got, pages * PAGE_SIZE);
+    } else {
+      const auto victim = rng() % live.size();
+      const auto [base, size] = live[victim];
+      live[victim] = live.back();
+      live.pop_back();
+      tree->insert(base, size);
+      for (size_t j = 0; j < size / PAGE_SIZE; ++j)
+        used[(base - BASE) / PAGE_SIZE + j] = false;
+    }
+
+    size_t expected_ranges = 0;
+    for (size_t i = 0; i < PAGES; ++i)
+      if (!used[i] && (i == 0 || used[i - 1]))
+        ++expected_ranges;
+    ASSERT_EQ(tree->range_count(), expected_ranges) << round;
+  }
+}
+
+// 100k interleaved allocations and frees of mixed sizes, over an address space
+// fragmented into thousands of free ranges.
+TEST(range_tree_bench, interleaved_alloc_free) {
+  constexpr size_t OPS = 100000;
+  tree_with_storage tree{1 << 16};
+  tree->insert(0xFFFF800000000000, 1ULL << 40);
+  std::vector<std::pair<uintptr_t, size_t>> live;
+  live.reserve(OPS);
+  std::mt19937 rng{42};
+
+  // Start with a few thousand allocations live, so there's something to
+  // fragment.
+  for (int i = 0; i < 8192; ++i) {
+    const size_t size = (1 + rng() % 64) * PAGE_SIZE;
+    live.emplace_back(*tree->allocate(size, PAGE_SIZE), size);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < OPS; ++i) {
+    if (rng() % 2) {
+      const size_t size = (1 + rng() % 64) * PAGE_SIZE;
+      const auto got = tree->allocate(size, PAGE_SIZE);
+      ASSERT_TRUE(got);
+      live.emplace_back(*got, size);
+    } else if (!live.empty()) {
+      const auto victim = rng() % live.size();
+      const auto [base, size] = live[victim];
+      live[victim] = live.back();
+      live.pop_back();
+      tree->insert(base, size);
+    }
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  const auto ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  printf("range_tree: %zu ops, %zu free ranges at the end: %.1f ns per op\n",
+         OPS, tree->range_count(), (double)ns / OPS);
+}